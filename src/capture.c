@@ -22,211 +22,587 @@
 #include "hardware/clocks.h"
 #include "hardware/dma.h"
 #include "hardware/irq.h"
+#include "hardware/pwm.h"
+#include "pico/multicore.h"
 #include "pico/stdlib.h"
 #include "string.h"
 
-#define PRE_TRIGGER_RING_BITS 10
-#define PRE_TRIGGER_BUFFER_SIZE (1 << PRE_TRIGGER_RING_BITS)
-#define PRE_TRIGGER_RING_TRANSFER_COUNT ((0xffffffffu / PRE_TRIGGER_BUFFER_SIZE) * PRE_TRIGGER_BUFFER_SIZE)
-#define POST_TRIGGER_BUFFER_SIZE 100000
+// Buffer sizes are in 32 bit words. Each word holds 32 / sample width samples. The sample buffer is shared by the pre
+// trigger ring and the post trigger samples, split at capture start
+#define SAMPLE_BUFFER_SIZE (56 * 1024)
+#define PRE_TRIGGER_RING_MIN_SIZE 256
+#define RLE_STAGING_RING_BITS 10
+#define RLE_STAGING_SIZE (1 << RLE_STAGING_RING_BITS)
+#define RLE_MAX_RUN_LENGTH 0x10000
+#define RLE_NOMINAL_RATIO 8
 #define MAX_TRIGGER_COUNT 4
-#define RATE_CHANGE_CLK 5000
-
-static const uint sm_pre_trigger_ = 0, sm_post_trigger_ = 1, sm_mux_ = 3, dma_channel_pre_trigger_ = 0,
-                  dma_channel_post_trigger_ = 1, dma_channel_pio0_ctrl_ = 2, dma_channel_pio1_ctrl_ = 3,
-                  dma_channel_reload_pre_trigger_counter_ = 4, dma_channel_trigger_[MAX_TRIGGER_COUNT] = {5, 6, 7, 8},
-                  sm_trigger_[MAX_TRIGGER_COUNT] = {0, 1, 2, 3}, reload_counter_ = PRE_TRIGGER_RING_TRANSFER_COUNT;
-static uint offset_pre_trigger_, offset_post_trigger_, pre_trigger_samples_, post_trigger_samples_, pre_trigger_count_,
-    pin_count_, trigger_count_, sm_trigger_mask_, trigger_mask_, pin_base_, rate_, offset_mux_,
-    offset_trigger_[MAX_TRIGGER_COUNT];
-static int pre_trigger_first_, triggered_channel_;
-static float clk_div_;
-static volatile uint pio0_ctrl_ = (1 << sm_post_trigger_), pio1_ctrl_ = 0;
-static uint16_t pre_trigger_buffer_[PRE_TRIGGER_BUFFER_SIZE]
-    __attribute__((aligned(PRE_TRIGGER_BUFFER_SIZE * sizeof(uint16_t)))),
-    post_trigger_buffer_[POST_TRIGGER_BUFFER_SIZE];
-static bool is_capturing_ = false, is_aborting_ = false;
-static pio_sm_config pio_config_trigger_[MAX_TRIGGER_COUNT], pio_config_pre_trigger_, pio_config_post_trigger_,
-    pio_config_mux_;
+#define CAPTURE_LOOP_CYCLES 3
+#define STREAM_BLOCK_SIZE 1024
+#define STREAM_BLOCK_SAMPLES (STREAM_BLOCK_SIZE * 2)
+#define STREAM_BLOCK_COUNT (SAMPLE_BUFFER_SIZE / STREAM_BLOCK_SIZE)
+// Samples captured between the trigger and the hand-off to the post trigger channel are kept in the pre trigger ring
+#define SEAM_MARGIN_SAMPLES 64
+#define CAPTURE_FIFO_DEPTH 8
+#define SELF_TEST_SAMPLES 2048
+#define SELF_TEST_PRE_TRIGGER_SAMPLES 1024
+#define SELF_TEST_CLOCK_PERIOD 16
+#define BENCHMARK_SAMPLES 65536
+#define BENCHMARK_RLE_WORDS (8 * RLE_STAGING_SIZE)
+#define BENCHMARK_RLE_CYCLES_MAX 40
+// Channels 0-15 are GPIO 0-15, 16-18 are GPIO 20-22, 19-21 are GPIO 26-28, 22-23 are GPIO 18-19 (boot configuration,
+// read before the capture init) and 24-25 are GPIO 16-17 (debug output and external clock). GPIO 23-25 are used by the
+// board
+#define CHANNEL_GPIO_MASK 0x1c7fffffu
+#define CHANNEL_GPIO_CONTIGUOUS 16
+// Transition capture: the program loop and the transition push in sys clock cycles. Samples reported in the metadata:
+// the depth depends on the transitions count and not on the samples
+#define TRANSITION_LOOP_CYCLES 7
+#define TRANSITION_PUSH_LOOPS 2
+#define TRANSITION_MAX_SAMPLES 0x3fffffff
+
+// UART trigger bit time in trigger program cycles
+#define UART_TRIGGER_BIT_CYCLES 8
+
+static const uint sm_capture_ = 0, sm_mux_ = 3, dma_channel_pre_trigger_ = 0, dma_channel_post_trigger_ = 1,
+                  dma_channel_hand_off_ = 2, dma_channel_stop_ = 3, dma_channel_reload_pre_trigger_address_ = 4,
+                  dma_channel_post_trigger_timer_ = 4, dma_timer_ = 0,
+                  dma_channel_trigger_[MAX_TRIGGER_COUNT] = {5, 6, 7, 8}, dma_channel_post_trigger_stream_ = 9,
+                  dma_channel_trigger_cycle_ = 10, dma_channel_seam_cycle_ = 11, pwm_cycle_counter_ = 7,
+                  sm_trigger_[MAX_TRIGGER_COUNT] = {0, 1, 2, 3};
+static const uint8_t channel_gpio_[CHANNEL_COUNT] = {0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12,
+                                                    13, 14, 15, 20, 21, 22, 26, 27, 28, 18, 19, 16, 17};
+static const uint self_test_rate_[] = {200000000, 100000000, 50000000, 10000000, 1000000, 100000};
+// Benchmark: sys clock cycles per sample of the rates tried, fastest first
+static const uint benchmark_cycles_[] = {1, 2, 3, 4, 5, 8, 10, 20, 200};
+static uint benchmark_max_rate_[CAPTURE_WIDTHS_COUNT], benchmark_rle_max_rate_[CAPTURE_WIDTHS_COUNT];
+static bool is_benchmarked_ = false;
+static uint capture_status_;
+static uint offset_capture_, pre_trigger_samples_, post_trigger_samples_, pre_trigger_count_, pre_trigger_ring_size_,
+    rle_buffer_size_, rle_words_total_, rle_cursor_, rle_cursor_start_, pin_count_, trigger_count_, sm_trigger_mask_,
+    trigger_mask_, pin_base_, rate_, offset_mux_, offset_trigger_[MAX_TRIGGER_COUNT], sample_base_, sample_width_,
+    sample_mask_, samples_per_word_bits_, window_first_, window_count_, stored_count_, trigger_latency_,
+    trigger_check_cycles_[MAX_TRIGGER_COUNT], segments_count_, segment_, segment_size_, segment_selected_;
+static int pre_trigger_first_, triggered_channel_, trigger_index_;
+static uint cycles_per_sample_;
+static volatile uint pre_trigger_pause_ctrl_;
+static uint pre_trigger_abort_ctrl_;
+static volatile uint64_t trigger_time_;
+static volatile uint32_t trigger_cycle_[MAX_TRIGGER_COUNT], seam_cycle_, pio0_ctrl_stop_ = 0, transition_timer_count_;
+static uint32_t channel_gpio_mask_;
+static uint32_t sample_buffer_[SAMPLE_BUFFER_SIZE] __attribute__((aligned(RLE_STAGING_SIZE * sizeof(uint32_t)))),
+    *pre_trigger_buffer_, *post_trigger_buffer_, *pre_trigger_ring_address_;
+static bool is_capturing_ = false, is_aborting_ = false, is_streaming_ = false, is_rle_ = false,
+            is_clock_external_ = false, is_trigger_exact_ = false, is_seam_stalled_ = false,
+            is_segmented_ = false, is_gpio_order_ = false, is_transition_ = false;
+static volatile bool self_test_is_complete_;
+static volatile bool rle_is_done_, rle_is_overrun_, rle_is_full_;
+static volatile uint rle_samples_, rle_runs_;
+static volatile bool stream_overrun_ = false;
+static volatile uint stream_write_block_, stream_read_block_;
+static uint stream_blocks_total_, stream_samples_total_;
+static uint transitions_count_, transition_cursor_;
+static uint64_t transition_time_;
+static uint32_t transition_start_ctrl_;
+static uint16_t trigger_instructions_[MAX_TRIGGER_COUNT][PIO_INSTRUCTION_COUNT];
+static uint32_t trigger_value_[MAX_TRIGGER_COUNT];
+static pio_program_t trigger_program_[MAX_TRIGGER_COUNT];
+static trigger_t trigger_set_[MAX_TRIGGER_COUNT];
+static pio_sm_config pio_config_trigger_[MAX_TRIGGER_COUNT], pio_config_capture_, pio_config_mux_;
+static dma_channel_config channel_config_pre_trigger_;
 static const uint triggered_channel_index_[4] = {0, 1, 2, 3};
+static const char *trigger_match_name_[] = {"Level", "Edge", "UART", "SPI", "I2C"};
+
+// Segmented capture: the capture state of each segment, restored to read its samples
+typedef struct segment_t {
+    uint32_t *buffer;  // pre trigger ring, followed by the post trigger samples
+    int pre_trigger_first, trigger_index;
+    uint pre_trigger_count, stored_count, window_first, window_count, trigger_latency;
+    bool is_trigger_exact, is_stalled;
+    uint64_t trigger_time;
+} segment_t;
+static segment_t segment_state_[CAPTURE_SEGMENTS_MAX];
+
+typedef enum capture_program_t {
+    CAPTURE_PROGRAM_CLOCK_DIVIDER,
+    CAPTURE_PROGRAM_LOOP,
+    CAPTURE_PROGRAM_EXTERNAL,
+    CAPTURE_PROGRAM_TRANSITION
+} capture_program_t;
+
+// Armed configuration key: everything the loaded programs and their state machine configs depend on
+typedef struct armed_key_t {
+    capture_program_t program;
+    uint sample_base, sample_width, cycles_per_sample;
+    bool clock_invert;
+    trigger_t trigger[MAX_TRIGGER_COUNT];
+} armed_key_t;
+static armed_key_t armed_key_;
+static bool is_armed_ = false;
+
+// Sustained rate of the core1 encoder for 1, 2, 4, 8 and 16 bit samples, estimated from the encoder cycles per word and
+// per sample at 200 MHz. Replaced by the rates measured by the benchmark once it has run. Runs hold 16 bit samples: no
+// RLE for 32 bit samples
+static const uint rle_max_rate_[CAPTURE_WIDTHS_COUNT] = {25000000, 24000000, 23000000, 20000000, 15000000, 0};
 
 static void (*handler_)(void) = NULL;
 
 static inline void capture_complete_handler(void);
+static inline void stream_block_handler(void);
+static inline void save_segment(uint segment);
+static inline void select_segment(uint segment);
+static inline void rearm_segment(void);
 static inline void trigger_handler(void);
+static inline void set_trigger_index(void);
+static inline bool is_trigger_match(trigger_t trigger, uint sample);
+static void self_test_complete_handler(void);
+static inline bool self_test_run(uint rate);
+static inline bool benchmark_run(uint samples, uint rate, uint clock_samples);
 static inline void capture_stop(void);
-static inline bool set_trigger(trigger_t trigger);
+static inline void set_capture_channels(bool is_triggered, uint post_trigger_size);
+static inline void set_transition_channels(bool is_triggered);
+static inline void set_transition_range(void);
+static inline void load_programs(const armed_key_t *key);
+static inline bool load_trigger(trigger_t trigger);
+static inline void arm_trigger(uint index);
+static inline uint compile_trigger(trigger_t trigger, uint16_t *program, uint32_t *value, uint *wrap_target,
+                                   uint *wrap, uint *cycles);
+static inline uint compile_protocol_trigger(trigger_t trigger, uint16_t *program, uint32_t *value, uint *wrap_target,
+                                            uint *wrap, uint *cycles);
+static inline uint get_sample_width(uint channel_mask, uint *sample_base);
+static inline uint get_width_rle_max_rate(uint width_index);
+static inline uint get_channel_gpio(uint channel);
+static inline uint32_t get_gpio_mask(uint32_t channel_mask);
+static inline uint32_t get_channel_value(uint32_t gpio_value);
+static inline uint32_t get_channel_gpio_mask(void);
+static inline void set_channel_order(uint32_t *words, uint count);
+static inline void set_gpio_inputs_masked(bool is_masked);
+static inline uint get_stored_sample(uint index);
+static inline uint get_sample(const uint32_t *buffer, uint index);
+static inline uint get_rle_sample(uint index);
+static inline uint get_transition_sample(uint index);
+static inline uint get_transition_value(uint index);
+static inline uint64_t get_transition_time(uint index);
+static inline uint64_t get_transition_cycles(uint index);
+static inline uint64_t get_transition_first(uint index);
+static void rle_encoder(void);
 
-void capture_init(uint pin_base, uint pin_count, complete_handler_t handler) {
+static void pio_capture_init(uint pin_base, uint pin_count, complete_handler_t handler) {
     handler_ = handler;
     pin_count_ = pin_count;
     pin_base_ = pin_base;
 
-    // Init pins
+    // Init pins. The debug output is left as it is
+    channel_gpio_mask_ = get_channel_gpio_mask();
     for (uint i = 0; i < pin_count_; i++) {
-        gpio_set_dir(pin_base_ + i, false);
-        gpio_pull_down(pin_base_ + i);
+        uint gpio = get_channel_gpio(pin_base_ + i);
+        if (!(channel_gpio_mask_ & (1u << gpio))) continue;
+        gpio_set_dir(gpio, false);
+        gpio_pull_down(gpio);
     }
+    gpio_set_dir(GPIO_CLOCK_EXTERNAL, false);
+    gpio_pull_down(GPIO_CLOCK_EXTERNAL);
+
+    // Cycle counter: a PWM slice without output counting sys clock cycles. Trigger and hand-off times are copied from
+    // its counter by DMA
+    pwm_config config_cycle_counter = pwm_get_default_config();
+    pwm_config_set_clkdiv_int(&config_cycle_counter, 1);
+    pwm_config_set_wrap(&config_cycle_counter, 0xffff);
+    pwm_init(pwm_cycle_counter_, &config_cycle_counter, true);
+
+    // Interrupts: trigger from the mux and capture complete from the post trigger channel
+    pio_set_irq0_source_enabled(pio0, (enum pio_interrupt_source)(pis_interrupt0), true);
+    irq_set_exclusive_handler(PIO0_IRQ_0, trigger_handler);
+    irq_set_enabled(PIO0_IRQ_0, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, capture_complete_handler);
+    irq_set_enabled(DMA_IRQ_0, true);
 }
 
-void capture_start(uint samples, uint rate, uint pre_trigger_samples) {
+static void pio_capture_start(uint samples, uint rate, uint pre_trigger_samples) {
+    uint32_t arm_start = time_us_32();
     if (pre_trigger_samples > samples) pre_trigger_samples = samples;
 
+    // Stream: no pre trigger samples and no limit on total samples
+    is_streaming_ = capture_config_.mode == CAPTURE_MODE_STREAM;
+    is_rle_ = capture_config_.mode == CAPTURE_MODE_RLE;
+    is_transition_ = capture_config_.mode == CAPTURE_MODE_TRANSITION;
+    is_clock_external_ = capture_config_.clock_external && !is_transition_;
+    channel_gpio_mask_ = get_channel_gpio_mask();
+
+    // Segmented: the samples and the sample memory are split into equal segments, one per trigger
+    is_segmented_ = capture_config_.mode == CAPTURE_MODE_SEGMENTED && capture_config_.trigger[0].is_enabled &&
+                    capture_config_.segments > 1;
+    segments_count_ = 1;
+    segment_ = 0;
+    segment_selected_ = 0;
+    if (is_segmented_) {
+        segments_count_ =
+            capture_config_.segments < CAPTURE_SEGMENTS_MAX ? capture_config_.segments : CAPTURE_SEGMENTS_MAX;
+        samples /= segments_count_;
+        pre_trigger_samples /= segments_count_;
+    }
+    if (is_transition_) pre_trigger_samples = 0;
+    if (is_streaming_) {
+        pre_trigger_samples = 0;
+        stream_samples_total_ = samples;
+        stream_blocks_total_ = (samples + STREAM_BLOCK_SAMPLES - 1) / STREAM_BLOCK_SAMPLES;
+        stream_write_block_ = 0;
+        stream_read_block_ = 0;
+        stream_overrun_ = false;
+    }
+
     pre_trigger_samples_ = pre_trigger_samples;
     post_trigger_samples_ = samples - pre_trigger_samples;
+    counters_.samples = 0;
+    counters_.pre_trigger_missing = 0;
+    capture_status_ = 0;
     rate_ = rate;
 
-    if (pre_trigger_samples_ > PRE_TRIGGER_BUFFER_SIZE) pre_trigger_samples_ = PRE_TRIGGER_BUFFER_SIZE;
-    if (post_trigger_samples_ > POST_TRIGGER_BUFFER_SIZE) post_trigger_samples_ = POST_TRIGGER_BUFFER_SIZE;
+    // Sample packing. Stream samples are not packed. 32 bit samples are captured from GPIO 0-31 and are reordered to
+    // the channels order once the capture is read. Transition values are reordered when they are read
+    sample_width_ = get_sample_width(is_streaming_ ? 0xffff : capture_config_.channel_mask, &sample_base_);
+    sample_mask_ = 0xffffffffu >> (32 - sample_width_);
+    is_gpio_order_ = sample_width_ == 32 && !is_transition_;
+    set_gpio_inputs_masked(sample_width_ == 32 && is_transition_);
+    samples_per_word_bits_ = 5 - __builtin_ctz(sample_width_);
 
-    // Set sys clock
-    if (rate > RATE_CHANGE_CLK) {
-        if (clock_get_hz(clk_sys) != 200000000) {
-            set_sys_clock_khz(200000, true);
-            debug_reinit();
-        }
-        clk_div_ = (float)clock_get_hz(clk_sys) / rate;
-    } else {
-        if (clock_get_hz(clk_sys) != 100000000) {
-            set_sys_clock_khz(100000, true);
-            debug_reinit();
-        }
-        clk_div_ = (float)clock_get_hz(clk_sys) / rate / 32 / 10;
-    }
-    if (clk_div_ > 0xffff) clk_div_ = 0xffff;
-
-    debug_block("\nSys Clk: %u Clk div (%s): %f", clock_get_hz(clk_sys), rate > RATE_CHANGE_CLK ? "fast" : "slow",
-                clk_div_);
-
-    // DMA channel pio0 control: disable pre trigger and enable post trigger
-    dma_channel_config config_dma_channel_pio0_ctrl = dma_channel_get_default_config(dma_channel_pio0_ctrl_);
-    channel_config_set_transfer_data_size(&config_dma_channel_pio0_ctrl, DMA_SIZE_32);
-    channel_config_set_write_increment(&config_dma_channel_pio0_ctrl, false);
-    channel_config_set_read_increment(&config_dma_channel_pio0_ctrl, false);
-    channel_config_set_dreq(&config_dma_channel_pio0_ctrl, pio_get_dreq(pio0, sm_mux_, false));
-    channel_config_set_chain_to(&config_dma_channel_pio0_ctrl, dma_channel_pio1_ctrl_);
-    dma_channel_configure(dma_channel_pio0_ctrl_, &config_dma_channel_pio0_ctrl,
-                          &pio0->ctrl,  // write address
-                          &pio0_ctrl_,  // read address
-                          1, false);
+    // Split the sample buffer: pre trigger ring first, post trigger samples after it. The ring is kept above a minimum
+    // size when there is room, so the ring address reload does not happen too often. RLE: the buffer starts with the
+    // staging ring for the raw post trigger samples, and the runs are stored after the pre trigger ring. Post trigger
+    // samples are not limited by the buffer size, and half of the buffer is kept for the runs. With triggers the
+    // capture state machine runs from the start, so the ring is always used and keeps a margin for the trigger latency
+    uint seam_margin = capture_config_.trigger[0].is_enabled ? SEAM_MARGIN_SAMPLES : 0;
+    uint buffer_size = (SAMPLE_BUFFER_SIZE - (is_rle_ ? RLE_STAGING_SIZE : 0)) / segments_count_;
+    uint samples_max = buffer_size << samples_per_word_bits_;
+    if (is_rle_) samples_max /= 2;
+    if (pre_trigger_samples_ > samples_max - seam_margin) pre_trigger_samples_ = samples_max - seam_margin;
+    if (!is_rle_ && !is_transition_ && post_trigger_samples_ > samples_max - seam_margin - pre_trigger_samples_)
+        post_trigger_samples_ = samples_max - seam_margin - pre_trigger_samples_;
+    uint post_trigger_size = (post_trigger_samples_ + (1 << samples_per_word_bits_) - 1) >> samples_per_word_bits_;
+    pre_trigger_ring_size_ = 0;
+    if (pre_trigger_samples_ + seam_margin) {
+        uint size = (pre_trigger_samples_ + seam_margin + (1 << samples_per_word_bits_) - 1) >> samples_per_word_bits_;
+        uint size_max = is_rle_ ? buffer_size / 2 : buffer_size - post_trigger_size;
+        pre_trigger_ring_size_ = size > PRE_TRIGGER_RING_MIN_SIZE ? size : PRE_TRIGGER_RING_MIN_SIZE;
+        if (pre_trigger_ring_size_ > size_max) pre_trigger_ring_size_ = size_max;
+    }
+    pre_trigger_buffer_ = &sample_buffer_[is_rle_ ? RLE_STAGING_SIZE : 0];
+    post_trigger_buffer_ = &pre_trigger_buffer_[pre_trigger_ring_size_];
+    segment_size_ = buffer_size;
+    if (is_transition_) {
+        // The transitions are stored from the buffer start: no pre trigger ring
+        pre_trigger_ring_size_ = 0;
+        post_trigger_buffer_ = sample_buffer_;
+        transitions_count_ = 0;
+        transition_cursor_ = 0;
+        transition_time_ = 0;
+    }
+    if (is_rle_) {
+        rle_buffer_size_ = buffer_size - pre_trigger_ring_size_;
+        rle_words_total_ = post_trigger_size;
+        rle_samples_ = 0;
+        rle_runs_ = 0;
+        rle_is_done_ = false;
+        rle_is_overrun_ = false;
+        rle_is_full_ = false;
+    }
 
-    // DMA channel pio1 control: disable mux and triggers
-    dma_channel_config config_dma_channel_pio1_ctrl = dma_channel_get_default_config(dma_channel_pio1_ctrl_);
-    channel_config_set_transfer_data_size(&config_dma_channel_pio1_ctrl, DMA_SIZE_32);
-    channel_config_set_write_increment(&config_dma_channel_pio1_ctrl, false);
-    channel_config_set_read_increment(&config_dma_channel_pio1_ctrl, false);
-    dma_channel_configure(dma_channel_pio1_ctrl_, &config_dma_channel_pio1_ctrl,
-                          &pio1->ctrl,  // write address
-                          &pio1_ctrl_,  // read address
-                          1, false);
+    // Rate plan: sys clock cycles per sample at the fixed sys clock. Up to 65535 cycles the capture program runs with
+    // an integer clock divider, above it the capture loop runs at the sys clock with a delay loop. The rate is exact
+    // when the sys clock is a multiple of it, otherwise the nearest rate is used. External clock: the rate is set by
+    // the clock, so the fastest rate is assumed for the trigger checks. Transition: the program runs at the sys clock
+    // and the rate only sets the samples the transitions are expanded to
+    cycles_per_sample_ = is_clock_external_ ? 1 : (clock_get_hz(clk_sys) + rate / 2) / rate;
+    if (!cycles_per_sample_) cycles_per_sample_ = 1;
+    rate_ = is_clock_external_ ? 0 : clock_get_hz(clk_sys) / cycles_per_sample_;
+    bool is_loop = !is_clock_external_ && !is_transition_ && cycles_per_sample_ > 0xffff;
 
-    dma_channel_start(dma_channel_pio0_ctrl_);
-
-    // DMA channel pre trigger reload counter
-    dma_channel_config config_dma_channel_reload_pre_trigger_counter =
-        dma_channel_get_default_config(dma_channel_reload_pre_trigger_counter_);
-    channel_config_set_transfer_data_size(&config_dma_channel_reload_pre_trigger_counter, DMA_SIZE_32);
-    channel_config_set_write_increment(&config_dma_channel_reload_pre_trigger_counter, false);
-    channel_config_set_read_increment(&config_dma_channel_reload_pre_trigger_counter, false);
-    dma_channel_configure(dma_channel_reload_pre_trigger_counter_, &config_dma_channel_reload_pre_trigger_counter,
-                          &dma_hw->ch[dma_channel_pre_trigger_].al1_transfer_count_trig,  // write address
-                          &reload_counter_,                                               // read address
-                          1, false);
+    // Armed configuration: the programs of the last capture are kept loaded and reused when its key is unchanged
+    armed_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.program = is_transition_       ? CAPTURE_PROGRAM_TRANSITION
+                  : is_clock_external_ ? CAPTURE_PROGRAM_EXTERNAL
+                  : is_loop            ? CAPTURE_PROGRAM_LOOP
+                                       : CAPTURE_PROGRAM_CLOCK_DIVIDER;
+    key.sample_base = sample_base_;
+    key.sample_width = sample_width_;
+    key.cycles_per_sample = cycles_per_sample_;
+    key.clock_invert = is_clock_external_ && capture_config_.clock_invert;
+    for (uint i = 0; i < MAX_TRIGGER_COUNT && capture_config_.trigger[i].is_enabled; i++) {
+        key.trigger[i].is_enabled = true;
+        key.trigger[i].mask = get_gpio_mask(capture_config_.trigger[i].mask) & channel_gpio_mask_;
+        key.trigger[i].value = get_gpio_mask(capture_config_.trigger[i].value) & channel_gpio_mask_;
+        key.trigger[i].match = capture_config_.trigger[i].match;
+        if (key.trigger[i].match >= TRIGGER_MATCH_UART) {
+            // Protocol triggers: the value is a byte, the channels are GPIOs
+            key.trigger[i].value = capture_config_.trigger[i].value;
+            for (uint j = 0; j < TRIGGER_CHANNELS_COUNT; j++) {
+                uint channel = capture_config_.trigger[i].channel[j];
+                key.trigger[i].channel[j] = channel == TRIGGER_CHANNEL_NONE ? channel : get_channel_gpio(channel);
+            }
+            key.trigger[i].baud_rate = capture_config_.trigger[i].baud_rate;
+            key.trigger[i].spi_mode = capture_config_.trigger[i].spi_mode;
+        }
+    }
+    bool is_cached = is_armed_ && !memcmp(&key, &armed_key_, sizeof(key));
+    if (!is_cached) {
+        load_programs(&key);
+        armed_key_ = key;
+        is_armed_ = true;
+    }
+
+    // Capture state machine. It runs from the capture start: its samples go to the pre trigger ring until the trigger
+    // and to the post trigger buffer after it, so no sample is lost or repeated at the seam. The joined FIFO holds the
+    // samples captured while the DMA channels are switched
+    pio_sm_config config_capture = pio_config_capture_;
+    pio_sm_init(pio0, sm_capture_, offset_capture_, &config_capture);
+    if (is_loop) {
+        // Delay loop count to Y. The TX FIFO is joined to the RX FIFO after it is used
+        pio_sm_put(pio0, sm_capture_, cycles_per_sample_ - CAPTURE_LOOP_CYCLES);
+        pio_sm_exec(pio0, sm_capture_, pio_encode_pull(false, true));
+        pio_sm_exec(pio0, sm_capture_, pio_encode_mov(pio_y, pio_osr));
+    }
+    if (is_transition_) {
+        // No last value, so the first sample is pushed. The count starts at 0xffffffff
+        pio_sm_exec(pio0, sm_capture_, pio_encode_mov_not(pio_y, pio_null));
+        pio_sm_exec(pio0, sm_capture_, pio_encode_mov_not(pio_osr, pio_null));
+    }
+    sm_config_set_fifo_join(&config_capture, PIO_FIFO_JOIN_RX);
+    pio_sm_set_config(pio0, sm_capture_, &config_capture);
+    pio0->fdebug = 1u << (PIO_FDEBUG_RXSTALL_LSB + sm_capture_);
 
     // PIO mux
-    offset_mux_ = pio_add_program(pio0, &mux_program);
-    pio_config_mux_ = mux_program_get_default_config(offset_mux_);
-    sm_config_set_clkdiv(&pio_config_mux_, 1);
-    pio_set_irq0_source_enabled(pio0, (enum pio_interrupt_source)(pis_interrupt0), true);
     pio_sm_init(pio0, sm_mux_, offset_mux_, &pio_config_mux_);
-    irq_set_exclusive_handler(PIO0_IRQ_0, trigger_handler);
-    irq_set_enabled(PIO0_IRQ_0, true);
 
-    // Init pre trigger
-    if (rate > RATE_CHANGE_CLK) {
-        offset_pre_trigger_ = pio_add_program(pio0, &capture_program);
-        pio_config_pre_trigger_ = capture_program_get_default_config(offset_pre_trigger_);
+    // DMA channels cycle snapshot: copy the cycle counter when a trigger fires and when the post trigger channel starts
+    dma_channel_config config_dma_channel_trigger_cycle = dma_channel_get_default_config(dma_channel_trigger_cycle_);
+    channel_config_set_transfer_data_size(&config_dma_channel_trigger_cycle, DMA_SIZE_32);
+    channel_config_set_write_increment(&config_dma_channel_trigger_cycle, true);
+    channel_config_set_read_increment(&config_dma_channel_trigger_cycle, false);
+    dma_channel_configure(dma_channel_trigger_cycle_, &config_dma_channel_trigger_cycle,
+                          trigger_cycle_,                          // write address
+                          &pwm_hw->slice[pwm_cycle_counter_].ctr,  // read address
+                          1, false);
+    dma_channel_config config_dma_channel_seam_cycle = dma_channel_get_default_config(dma_channel_seam_cycle_);
+    channel_config_set_transfer_data_size(&config_dma_channel_seam_cycle, DMA_SIZE_32);
+    channel_config_set_write_increment(&config_dma_channel_seam_cycle, false);
+    channel_config_set_read_increment(&config_dma_channel_seam_cycle, false);
+    channel_config_set_chain_to(&config_dma_channel_seam_cycle, dma_channel_post_trigger_);
+    dma_channel_configure(dma_channel_seam_cycle_, &config_dma_channel_seam_cycle,
+                          &seam_cycle_,                            // write address
+                          &pwm_hw->slice[pwm_cycle_counter_].ctr,  // read address
+                          1, false);
+
+    // Arm triggers
+    triggered_channel_ = -1;
+    for (uint i = 0; i < trigger_count_; i++) arm_trigger(i);
+    bool is_triggered = sm_trigger_mask_ != 0;
+    if (!is_triggered) is_segmented_ = false;
+
+    if (is_transition_)
+        set_transition_channels(is_triggered);
+    else
+        set_capture_channels(is_triggered, post_trigger_size);
+
+    // Start state machines. The trigger time is the start time until a trigger. Transition: the capture state machine
+    // is started by the trigger
+    trigger_time_ = time_us_64();
+    if (!is_triggered) {
+        pio_sm_set_enabled(pio0, sm_capture_, true);
+        if (is_transition_) dma_channel_start(dma_channel_post_trigger_timer_);
     } else {
-        offset_pre_trigger_ = pio_add_program(pio0, &capture_slow_program);
-        pio_config_pre_trigger_ = capture_slow_program_get_default_config(offset_pre_trigger_);
-    }
-    sm_config_set_in_pins(&pio_config_pre_trigger_, pin_base_);
-    sm_config_set_in_shift(&pio_config_pre_trigger_, false, true, pin_count_);
-    sm_config_set_clkdiv(&pio_config_pre_trigger_, clk_div_);
-    pio_sm_init(pio0, sm_pre_trigger_, offset_pre_trigger_, &pio_config_pre_trigger_);
-    if (rate > RATE_CHANGE_CLK)
-        pio0->instr_mem[offset_pre_trigger_] = pio_encode_in(pio_pins, pin_count_);
+        pio_enable_sm_mask_in_sync(pio0, (is_transition_ ? 0 : 1 << sm_capture_) | (1 << sm_mux_));
+        pio_set_sm_mask_enabled(pio1, sm_trigger_mask_, true);
+    }
+    is_capturing_ = true;
+    uint arm_time = time_us_32() - arm_start;
+    counters_.arm_time = arm_time;
+    counters_.captures++;
+
+    if (is_clock_external_)
+        debug_block("\nSys Clk: %u External clock on GPIO %u. Edge: %s", clock_get_hz(clk_sys), GPIO_CLOCK_EXTERNAL,
+                    capture_config_.clock_invert ? "falling" : "rising");
     else
-        pio0->instr_mem[offset_pre_trigger_] = pio_encode_in(pio_pins, pin_count_) | pio_encode_delay(31);
+        debug_block("\nSys Clk: %u Rate: %u Achieved rate: %u Cycles per sample: %u (%s)", clock_get_hz(clk_sys),
+                    rate, rate_, cycles_per_sample_, is_loop ? "loop" : "clock divider");
+    debug_block("\nArm time: %u us (%s)", arm_time, is_cached ? "cached" : "loaded");
+    if (!is_streaming_)
+        debug_block(
+            "\nCapture start. Samples: %u Rate: %u Pre trigger samples: %u Pre trigger ring: %u Channels: %u-%u Sample "
+            "width: %u",
+            pre_trigger_samples_ + post_trigger_samples_, rate_, pre_trigger_samples_,
+            pre_trigger_ring_size_ << samples_per_word_bits_, sample_base_, sample_base_ + sample_width_ - 1,
+            sample_width_);
+    if (is_segmented_)
+        debug_block("\nSegmented. Segments: %u Segment size: %u", segments_count_,
+                    segment_size_ << samples_per_word_bits_);
+    if (is_transition_)
+        debug_block("\nTransition. Resolution: %u cycles Max transitions: %u", TRANSITION_LOOP_CYCLES,
+                    SAMPLE_BUFFER_SIZE / 2);
+    else if (is_rle_)
+        debug_block("\nRLE. Staging ring: %u Runs memory: %u Max rate: %u", RLE_STAGING_SIZE << samples_per_word_bits_,
+                    rle_buffer_size_, get_width_rle_max_rate(__builtin_ctz(sample_width_)));
+    else if (is_streaming_)
+        debug_block("\nStream start. Samples: %u Rate: %u Block size: %u Blocks: %u", stream_samples_total_, rate_,
+                    STREAM_BLOCK_SAMPLES, STREAM_BLOCK_COUNT);
+}
+
+static inline void set_capture_channels(bool is_triggered, uint post_trigger_size) {
+    // DMA channel pre trigger reload address: restart the pre trigger channel at the ring start. The ring is not a
+    // power of two size, so the DMA ring wrap is not used. Its raw interrupt flag is set when the ring wraps
+    pre_trigger_ring_address_ = pre_trigger_buffer_;
+    dma_hw->intr = 1u << dma_channel_reload_pre_trigger_address_;
+    dma_channel_config config_dma_channel_reload_pre_trigger_address =
+        dma_channel_get_default_config(dma_channel_reload_pre_trigger_address_);
+    channel_config_set_transfer_data_size(&config_dma_channel_reload_pre_trigger_address, DMA_SIZE_32);
+    channel_config_set_write_increment(&config_dma_channel_reload_pre_trigger_address, false);
+    channel_config_set_read_increment(&config_dma_channel_reload_pre_trigger_address, false);
+    dma_channel_configure(dma_channel_reload_pre_trigger_address_, &config_dma_channel_reload_pre_trigger_address,
+                          &dma_hw->ch[dma_channel_pre_trigger_].al2_write_addr_trig,  // write address
+                          &pre_trigger_ring_address_,                                 // read address
+                          1, false);
+
+    // Init pre trigger. Only used with triggers
     dma_channel_config channel_config_pre_trigger = dma_channel_get_default_config(dma_channel_pre_trigger_);
-    channel_config_set_transfer_data_size(&channel_config_pre_trigger, DMA_SIZE_16);
-    channel_config_set_ring(&channel_config_pre_trigger, true, PRE_TRIGGER_RING_BITS + 1);
+    channel_config_set_transfer_data_size(&channel_config_pre_trigger, DMA_SIZE_32);
     channel_config_set_write_increment(&channel_config_pre_trigger, true);
     channel_config_set_read_increment(&channel_config_pre_trigger, false);
-    channel_config_set_dreq(&channel_config_pre_trigger, pio_get_dreq(pio0, sm_pre_trigger_, false));
-    channel_config_set_chain_to(&channel_config_pre_trigger, dma_channel_reload_pre_trigger_counter_);
+    channel_config_set_dreq(&channel_config_pre_trigger, pio_get_dreq(pio0, sm_capture_, false));
+    channel_config_set_chain_to(&channel_config_pre_trigger, dma_channel_reload_pre_trigger_address_);
+    pre_trigger_pause_ctrl_ = channel_config_get_ctrl_value(&channel_config_pre_trigger) & ~DMA_CH0_CTRL_TRIG_EN_BITS;
+    channel_config_pre_trigger_ = channel_config_pre_trigger;
+    dma_channel_config channel_config_pre_trigger_abort = channel_config_pre_trigger;
+    channel_config_set_chain_to(&channel_config_pre_trigger_abort, dma_channel_pre_trigger_);
+    channel_config_set_enable(&channel_config_pre_trigger_abort, false);
+    pre_trigger_abort_ctrl_ = channel_config_get_ctrl_value(&channel_config_pre_trigger_abort);
     dma_channel_configure(dma_channel_pre_trigger_, &channel_config_pre_trigger,
-                          &pre_trigger_buffer_,         // write address
-                          &pio0->rxf[sm_pre_trigger_],  // read address
-                          PRE_TRIGGER_RING_TRANSFER_COUNT, true);
-
-    // Init post trigger
-    if (rate > RATE_CHANGE_CLK) {
-        offset_post_trigger_ = pio_add_program(pio0, &capture_program);
-        pio_config_post_trigger_ = capture_program_get_default_config(offset_post_trigger_);
-    } else {
-        offset_post_trigger_ = pio_add_program(pio0, &capture_slow_program);
-        pio_config_post_trigger_ = capture_slow_program_get_default_config(offset_post_trigger_);
-    }
-    sm_config_set_in_pins(&pio_config_post_trigger_, pin_base_);
-    sm_config_set_in_shift(&pio_config_post_trigger_, false, true, pin_count_);
-    sm_config_set_clkdiv(&pio_config_post_trigger_, clk_div_);
-    pio_sm_init(pio0, sm_post_trigger_, offset_post_trigger_, &pio_config_post_trigger_);
-    if (rate > RATE_CHANGE_CLK)
-        pio0->instr_mem[offset_post_trigger_] = pio_encode_in(pio_pins, pin_count_);
-    else
-        pio0->instr_mem[offset_post_trigger_] = pio_encode_in(pio_pins, pin_count_) | pio_encode_delay(31);
+                          pre_trigger_buffer_,      // write address
+                          &pio0->rxf[sm_capture_],  // read address
+                          pre_trigger_ring_size_, is_triggered && pre_trigger_ring_size_ > 0);
+
+    // DMA channel hand-off: when the mux outputs the trigger, pause the pre trigger channel, then copy the cycle
+    // counter and start the post trigger channel. The capture state machine keeps running meanwhile
+    dma_channel_config config_dma_channel_hand_off = dma_channel_get_default_config(dma_channel_hand_off_);
+    channel_config_set_transfer_data_size(&config_dma_channel_hand_off, DMA_SIZE_32);
+    channel_config_set_write_increment(&config_dma_channel_hand_off, false);
+    channel_config_set_read_increment(&config_dma_channel_hand_off, false);
+    channel_config_set_dreq(&config_dma_channel_hand_off, pio_get_dreq(pio0, sm_mux_, false));
+    channel_config_set_chain_to(&config_dma_channel_hand_off, dma_channel_seam_cycle_);
+    dma_channel_configure(dma_channel_hand_off_, &config_dma_channel_hand_off,
+                          &dma_hw->ch[dma_channel_pre_trigger_].al1_ctrl,  // write address
+                          &pre_trigger_pause_ctrl_,                        // read address
+                          1, is_triggered);
+
+    // DMA channel stop: when the post trigger channel completes, disable the state machines before the capture state
+    // machine fills its FIFO and stalls, so a stall means lost samples
+    dma_channel_config channel_config_stop = dma_channel_get_default_config(dma_channel_stop_);
+    channel_config_set_transfer_data_size(&channel_config_stop, DMA_SIZE_32);
+    channel_config_set_write_increment(&channel_config_stop, false);
+    channel_config_set_read_increment(&channel_config_stop, false);
+    dma_channel_configure(dma_channel_stop_, &channel_config_stop,
+                          &pio0->ctrl,       // write address
+                          &pio0_ctrl_stop_,  // read address
+                          1, false);
+
+    // Init post trigger. With triggers it is started by the hand-off
     dma_channel_config channel_config_post_trigger = dma_channel_get_default_config(dma_channel_post_trigger_);
-    channel_config_set_transfer_data_size(&channel_config_post_trigger, DMA_SIZE_16);
+    channel_config_set_transfer_data_size(&channel_config_post_trigger, DMA_SIZE_32);
     channel_config_set_write_increment(&channel_config_post_trigger, true);
     channel_config_set_read_increment(&channel_config_post_trigger, false);
-    channel_config_set_dreq(&channel_config_post_trigger, pio_get_dreq(pio0, sm_post_trigger_, false));
+    channel_config_set_dreq(&channel_config_post_trigger, pio_get_dreq(pio0, sm_capture_, false));
+    channel_config_set_chain_to(&channel_config_post_trigger, dma_channel_stop_);
     dma_channel_set_irq0_enabled(dma_channel_post_trigger_, true);  // raise an interrupt when completed
-    irq_set_exclusive_handler(DMA_IRQ_0, capture_complete_handler);
-    irq_set_enabled(DMA_IRQ_0, true);
-    dma_channel_configure(dma_channel_post_trigger_, &channel_config_post_trigger,
-                          &post_trigger_buffer_,         // write address
-                          &pio0->rxf[sm_post_trigger_],  // read address
-                          post_trigger_samples_, true);
-
-    // Init triggers
-    trigger_count_ = 0;
-    sm_trigger_mask_ = 0;
-    triggered_channel_ = -1;
-    uint i = 0;
-    while (capture_config_.trigger[i].is_enabled) {
-        set_trigger(capture_config_.trigger[i]);
-        i++;
-    }
-
-    // Start state machines
-    if (!sm_trigger_mask_) {
-        pio_sm_set_enabled(pio0, sm_post_trigger_, true);
+    if (is_rle_) {
+        // RLE: raw samples go to the staging ring, core1 encodes them into the post trigger buffer
+        channel_config_set_ring(&channel_config_post_trigger, true, RLE_STAGING_RING_BITS + 2);
+        dma_channel_configure(dma_channel_post_trigger_, &channel_config_post_trigger,
+                              sample_buffer_,           // write address
+                              &pio0->rxf[sm_capture_],  // read address
+                              post_trigger_size, !is_triggered);
+        multicore_reset_core1();
+        multicore_launch_core1(rle_encoder);
+    } else if (!is_streaming_) {
+        dma_channel_configure(dma_channel_post_trigger_, &channel_config_post_trigger,
+                              post_trigger_buffer_,     // write address
+                              &pio0->rxf[sm_capture_],  // read address
+                              post_trigger_size, !is_triggered);
     } else {
-        pio_set_sm_mask_enabled(pio0, (1 << sm_pre_trigger_) | (1 << sm_mux_), true);
-        pio_set_sm_mask_enabled(pio1, sm_trigger_mask_, true);
+        // Stream: two channels chained to each other fill alternate blocks of the post trigger buffer. Each block
+        // completion interrupt moves the channel to its next block while the other channel is capturing
+        dma_channel_config channel_config_stream = channel_config_post_trigger;
+        channel_config_set_chain_to(&channel_config_post_trigger, dma_channel_post_trigger_stream_);
+        channel_config_set_chain_to(&channel_config_stream, dma_channel_post_trigger_);
+        dma_channel_set_irq0_enabled(dma_channel_post_trigger_stream_, true);
+        dma_channel_configure(dma_channel_post_trigger_stream_, &channel_config_stream,
+                              &sample_buffer_[STREAM_BLOCK_SIZE],  // write address
+                              &pio0->rxf[sm_capture_],             // read address
+                              STREAM_BLOCK_SIZE, false);
+        dma_channel_configure(dma_channel_post_trigger_, &channel_config_post_trigger,
+                              &sample_buffer_[0],       // write address
+                              &pio0->rxf[sm_capture_],  // read address
+                              STREAM_BLOCK_SIZE, !is_triggered);
     }
-    is_capturing_ = true;
+}
+
+static inline void set_transition_channels(bool is_triggered) {
+    /*
+     * The capture state machine pushes the value and the loop count of each transition, written to the sample buffer by
+     * the post trigger channel. The post trigger timer counts the capture time. The first of both channels to complete
+     * starts the stop channel and raises the complete interrupt. With triggers, the hand-off enables the capture state
+     * machine and starts the timer
+     */
+
+    dma_channel_config channel_config_stop = dma_channel_get_default_config(dma_channel_stop_);
+    channel_config_set_transfer_data_size(&channel_config_stop, DMA_SIZE_32);
+    channel_config_set_write_increment(&channel_config_stop, false);
+    channel_config_set_read_increment(&channel_config_stop, false);
+    dma_channel_configure(dma_channel_stop_, &channel_config_stop,
+                          &pio0->ctrl,       // write address
+                          &pio0_ctrl_stop_,  // read address
+                          1, false);
+
+    dma_channel_config channel_config_post_trigger = dma_channel_get_default_config(dma_channel_post_trigger_);
+    channel_config_set_transfer_data_size(&channel_config_post_trigger, DMA_SIZE_32);
+    channel_config_set_write_increment(&channel_config_post_trigger, true);
+    channel_config_set_read_increment(&channel_config_post_trigger, false);
+    channel_config_set_dreq(&channel_config_post_trigger, pio_get_dreq(pio0, sm_capture_, false));
+    channel_config_set_chain_to(&channel_config_post_trigger, dma_channel_stop_);
+    dma_channel_set_irq0_enabled(dma_channel_post_trigger_, true);
+    dma_channel_configure(dma_channel_post_trigger_, &channel_config_post_trigger,
+                          post_trigger_buffer_,     // write address
+                          &pio0->rxf[sm_capture_],  // read address
+                          SAMPLE_BUFFER_SIZE & ~1u, true);
+
+    // Timer pacing: one transfer per sample period, or per 65535 cycles for slower rates (16 bit denominator)
+    uint denominator = cycles_per_sample_ < 0xffff ? cycles_per_sample_ : 0xffff;
+    uint64_t ticks = ((uint64_t)post_trigger_samples_ * cycles_per_sample_ + denominator - 1) / denominator;
+    dma_timer_set_fraction(dma_timer_, 1, denominator);
+    dma_channel_config channel_config_timer = dma_channel_get_default_config(dma_channel_post_trigger_timer_);
+    channel_config_set_transfer_data_size(&channel_config_timer, DMA_SIZE_32);
+    channel_config_set_write_increment(&channel_config_timer, false);
+    channel_config_set_read_increment(&channel_config_timer, false);
+    channel_config_set_dreq(&channel_config_timer, dma_get_timer_dreq(dma_timer_));
+    channel_config_set_chain_to(&channel_config_timer, dma_channel_stop_);
+    dma_channel_set_irq0_enabled(dma_channel_post_trigger_timer_, true);
+    dma_channel_configure(dma_channel_post_trigger_timer_, &channel_config_timer,
+                          &transition_timer_count_,  // write address
+                          &transition_timer_count_,  // read address
+                          ticks < 0xffffffff ? ticks : 0xffffffff, false);
 
-    debug_block("\nCapture start. Samples: %u Rate: %u Pre trigger samples: %u",
-                pre_trigger_samples_ + post_trigger_samples_, rate_, pre_trigger_samples_);
+    // DMA channel hand-off: when the mux outputs the trigger, enable the capture state machine and start the timer
+    transition_start_ctrl_ = (1u << sm_capture_) | (1u << sm_mux_);
+    dma_channel_config config_dma_channel_hand_off = dma_channel_get_default_config(dma_channel_hand_off_);
+    channel_config_set_transfer_data_size(&config_dma_channel_hand_off, DMA_SIZE_32);
+    channel_config_set_write_increment(&config_dma_channel_hand_off, false);
+    channel_config_set_read_increment(&config_dma_channel_hand_off, false);
+    channel_config_set_dreq(&config_dma_channel_hand_off, pio_get_dreq(pio0, sm_mux_, false));
+    channel_config_set_chain_to(&config_dma_channel_hand_off, dma_channel_post_trigger_timer_);
+    dma_channel_configure(dma_channel_hand_off_, &config_dma_channel_hand_off,
+                          &pio0->ctrl,              // write address
+                          &transition_start_ctrl_,  // read address
+                          1, is_triggered);
 }
 
-void capture_abort(void) {
-    if (clock_get_hz(clk_sys) != 100000000) {
-        set_sys_clock_khz(100000, true);
-        debug_reinit();
-    }
+static void pio_capture_abort(void) {
     is_capturing_ = false;
     is_aborting_ = true;
     capture_stop();
@@ -234,143 +610,1112 @@ void capture_abort(void) {
     debug("\nCapture aborted");
 }
 
-bool capture_is_busy(void) { return is_capturing_; }
+static bool pio_capture_is_busy(void) { return is_capturing_; }
 
-uint get_sample_index(int index) {
-    uint total_samples = pre_trigger_count_ + post_trigger_samples_;
+static uint pio_get_sample_index(int index) {
+    if (index < 0) return 0;
+    if (is_segmented_) {
+        // Segments in capture order, each with its trigger sample after the pre trigger samples
+        uint length = pre_trigger_samples_ + post_trigger_samples_;
+        if ((uint)index >= segments_count_ * length) return 0;
+        select_segment(index / length);
+        index = (int)(index % length) - ((int)pre_trigger_samples_ - trigger_index_);
+        if (index < 0) return 0;
+    }
+    if ((uint)index >= window_count_) return 0;
+    return get_stored_sample(window_first_ + index);
+}
 
-    if (index < 0 || (uint)index >= total_samples) return 0;
+static uint pio_get_samples_count(void) {
+    return is_segmented_ ? segments_count_ * (pre_trigger_samples_ + post_trigger_samples_) : window_count_;
+}
 
-    if ((uint)index < pre_trigger_count_) {
-        int pos = pre_trigger_first_ + index;
+static uint pio_get_segments_count(void) { return is_segmented_ ? segments_count_ : 0; }
 
-        if (pos < 0)
-            pos += PRE_TRIGGER_BUFFER_SIZE;
-        else if (pos >= PRE_TRIGGER_BUFFER_SIZE)
-            pos -= PRE_TRIGGER_BUFFER_SIZE;
+static uint32_t pio_get_segment_time(uint segment) {
+    if (!is_segmented_ || segment >= segments_count_) return 0;
+    return segment_state_[segment].trigger_time - segment_state_[0].trigger_time;
+}
+
+static void pio_prepare_read(void) {
+    /*
+     * 32 bit samples are in GPIO order. Move them to the channels order once per capture, only the stored words of
+     * each segment. Called on core0 before the upload starts, so core1 only reads the samples
+     */
+
+    if (!is_gpio_order_) return;
+    uint selected = segment_selected_;
+    for (uint i = 0; i < (is_segmented_ ? segments_count_ : 1); i++) {
+        if (is_segmented_) select_segment(i);
+        set_channel_order(pre_trigger_buffer_, pre_trigger_count_);
+        set_channel_order(post_trigger_buffer_, stored_count_ - pre_trigger_count_);
+    }
+    if (is_segmented_) select_segment(selected);
+    is_gpio_order_ = false;
+}
+
+static uint pio_get_capture_rate(void) { return rate_; }
+
+static uint pio_get_capture_spans(capture_span_t spans[CAPTURE_SPANS_MAX]) {
+    // Oldest samples first. RLE and transition captures are not stored as samples and segments are padded to their
+    // trigger
+    if (is_rle_ || is_transition_ || is_streaming_ || is_segmented_) return 0;
+
+    capture_span_t stored[CAPTURE_SPANS_MAX];
+    uint stored_count = 0;
+    if (pre_trigger_count_) {
+        uint ring_size = pre_trigger_ring_size_ << samples_per_word_bits_;
+        uint first = pre_trigger_first_ < 0 ? pre_trigger_first_ + ring_size : (uint)pre_trigger_first_;
+        uint tail = ring_size - first < pre_trigger_count_ ? ring_size - first : pre_trigger_count_;
+        stored[stored_count++] = (capture_span_t){pre_trigger_buffer_, first, tail, sample_width_, sample_base_};
+        if (tail < pre_trigger_count_)
+            stored[stored_count++] =
+                (capture_span_t){pre_trigger_buffer_, 0, pre_trigger_count_ - tail, sample_width_, sample_base_};
+    }
+    if (post_trigger_samples_)
+        stored[stored_count++] =
+            (capture_span_t){post_trigger_buffer_, 0, post_trigger_samples_, sample_width_, sample_base_};
+
+    // Keep the samples of the window around the trigger
+    uint count = 0, skip = window_first_, left = window_count_;
+    for (uint i = 0; i < stored_count && left; i++) {
+        if (skip >= stored[i].count) {
+            skip -= stored[i].count;
+            continue;
+        }
+        spans[count] = stored[i];
+        spans[count].first += skip;
+        spans[count].count -= skip;
+        if (spans[count].count > left) spans[count].count = left;
+        left -= spans[count].count;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+static uint pio_get_max_samples(uint channel_mask, capture_mode_t mode) {
+    // RLE: the depth depends on the signal activity. Report a nominal compression ratio
+    uint sample_base;
+    uint max_samples = SAMPLE_BUFFER_SIZE << (5 - __builtin_ctz(get_sample_width(channel_mask, &sample_base)));
+    if (mode == CAPTURE_MODE_TRANSITION) return TRANSITION_MAX_SAMPLES;
+    return mode == CAPTURE_MODE_RLE ? max_samples * RLE_NOMINAL_RATIO : max_samples;
+}
+
+static uint pio_get_rle_max_rate(uint channel_mask) {
+    uint sample_base;
+    return get_width_rle_max_rate(__builtin_ctz(get_sample_width(channel_mask, &sample_base)));
+}
+
+static uint pio_capture_stream_get_block(const uint16_t **samples) {
+    if (stream_read_block_ == stream_write_block_) return 0;
+    *samples = (const uint16_t *)&sample_buffer_[(stream_read_block_ % STREAM_BLOCK_COUNT) * STREAM_BLOCK_SIZE];
+    if (stream_read_block_ == stream_blocks_total_ - 1)
+        return stream_samples_total_ - stream_read_block_ * STREAM_BLOCK_SAMPLES;
+    return STREAM_BLOCK_SAMPLES;
+}
+
+static void pio_capture_stream_release_block(void) {
+    if (stream_read_block_ != stream_write_block_) stream_read_block_++;
+}
+
+static bool pio_capture_stream_is_overrun(void) { return stream_overrun_; }
+
+static uint pio_get_pre_trigger_count(void) { return trigger_index_ < 0 ? 0 : trigger_index_; }
+
+static int pio_get_triggered_channel(void) { return triggered_channel_; }
+
+static int pio_get_trigger_index(void) { return triggered_channel_ < 0 ? -1 : trigger_index_; }
+
+static uint pio_get_trigger_latency(void) { return trigger_latency_; }
+
+static uint pio_get_capture_status(void) { return capture_status_; }
+
+static uint pio_get_transitions_count(void) { return is_transition_ ? transitions_count_ : 0; }
+
+static bool pio_get_transition(uint index, capture_transition_t *transition) {
+    if (!is_transition_ || index >= transitions_count_) return false;
+    transition->time = get_transition_time(index);
+    transition->sample = get_transition_first(index);
+    transition->value = get_transition_value(index);
+    return true;
+}
+
+static uint pio_get_max_rate(uint channel_mask) {
+    uint sample_base;
+    return benchmark_max_rate_[__builtin_ctz(get_sample_width(channel_mask, &sample_base))];
+}
+
+static uint pio_capture_benchmark(uint max_rates[CAPTURE_WIDTHS_COUNT], uint rle_max_rates[CAPTURE_WIDTHS_COUNT]) {
+    /*
+     * Find the highest rate without capture FIFO stalls for each sample width (1, 2, 4, 8, 16 and 32): untriggered
+     * one shot captures from the fastest rate down until one completes without a stall. The rates found are reported
+     * as the max rate in the metadata. Then find the highest RLE rate for each width up to 16 bits: RLE captures of
+     * 8 staging rings with a clock on channel 0 of two changes per word, so the encoder splits every word into
+     * samples, until one completes without an encoder overrun. Channel 0 must be disconnected. The RLE rates found
+     * limit the RLE captures. Returns the number of widths
+     */
+
+    if (is_capturing_) return 0;
+
+    capture_config_t capture_config = capture_config_;
+    void (*handler)(void) = handler_;
+    handler_ = self_test_complete_handler;
+    capture_config_.clock_external = false;
+    memset(capture_config_.trigger, 0, sizeof(capture_config_.trigger));
+    for (uint i = 0; i < CAPTURE_WIDTHS_COUNT; i++) {
+        capture_config_.channel_mask = (1u << i) < pin_count_ ? (1u << (1u << i)) - 1 : (1u << pin_count_) - 1;
+        capture_config_.mode = CAPTURE_MODE_ONE_SHOT;
+        max_rates[i] = 0;
+        for (uint j = 0; j < sizeof(benchmark_cycles_) / sizeof(benchmark_cycles_[0]) && !max_rates[i]; j++) {
+            uint rate = clock_get_hz(clk_sys) / benchmark_cycles_[j];
+            if (benchmark_run(BENCHMARK_SAMPLES, rate, 0)) max_rates[i] = rate;
+        }
+        benchmark_max_rate_[i] = max_rates[i];
 
-        return pre_trigger_buffer_[pos];
+        capture_config_.mode = CAPTURE_MODE_RLE;
+        rle_max_rates[i] = 0;
+        for (uint cycles = 1; cycles <= BENCHMARK_RLE_CYCLES_MAX && i < CAPTURE_WIDTHS_COUNT - 1 && !rle_max_rates[i];
+             cycles++) {
+            uint rate = clock_get_hz(clk_sys) / cycles;
+            if (rate <= max_rates[i] && benchmark_run(BENCHMARK_RLE_WORDS << (5 - i), rate, 16 >> i))
+                rle_max_rates[i] = rate;
+        }
+        benchmark_rle_max_rate_[i] = rle_max_rates[i];
+        debug("\nBenchmark. Sample width: %u Max rate: %u Max RLE rate: %u", 1u << i, max_rates[i], rle_max_rates[i]);
     }
+    capture_config_ = capture_config;
+    handler_ = handler;
+    is_benchmarked_ = true;
 
-    return post_trigger_buffer_[index - (int)pre_trigger_count_];
+    gpio_init(pin_base_);
+    gpio_set_dir(pin_base_, false);
+    gpio_pull_down(pin_base_);
+    return CAPTURE_WIDTHS_COUNT;
 }
 
-uint get_samples_count(void) { return pre_trigger_count_ + post_trigger_samples_; }
+static uint pio_capture_self_test(void) {
+    /*
+     * Capture a known edge at each test rate: channel 0 is driven high once the pre trigger samples are captured and
+     * channel 1 outputs a clock of SELF_TEST_CLOCK_PERIOD samples. The edge must be at the trigger index and the clock
+     * must keep its period across the seam. Channels 0 and 1 must be disconnected. Returns a mask of the passed rates
+     */
 
-uint get_pre_trigger_count(void) { return pre_trigger_count_; }
+    if (is_capturing_) return 0;
 
-int get_triggered_channel(void) { return triggered_channel_; }
+    capture_config_t capture_config = capture_config_;
+    void (*handler)(void) = handler_;
+    uint passed = 0;
+    handler_ = self_test_complete_handler;
+    capture_config_.channel_mask = 0x3;
+    capture_config_.mode = CAPTURE_MODE_ONE_SHOT;
+    capture_config_.clock_external = false;
+    memset(capture_config_.trigger, 0, sizeof(capture_config_.trigger));
+    capture_config_.trigger[0] =
+        (trigger_t){.is_enabled = true, .mask = 0x1, .value = 0x1, .match = TRIGGER_MATCH_EDGE};
+    for (uint i = 0; i < sizeof(self_test_rate_) / sizeof(self_test_rate_[0]); i++)
+        if (self_test_run(self_test_rate_[i])) passed |= 1u << i;
+    capture_config_ = capture_config;
+    handler_ = handler;
+
+    for (uint i = 0; i < 2; i++) {
+        gpio_init(pin_base_ + i);
+        gpio_set_dir(pin_base_ + i, false);
+        gpio_pull_down(pin_base_ + i);
+    }
+    debug("\nSelf test. Passed: 0x%02X", passed);
+    return passed;
+}
 
 static inline void capture_complete_handler(void) {
-    
+    if (is_streaming_) {
+        stream_block_handler();
+        return;
+    }
+
     dma_hw->ints0 = 1u << dma_channel_post_trigger_;
+    if (is_transition_) {
+        // Completed by the timer or by the transitions memory. The capture completes once
+        dma_hw->ints0 = 1u << dma_channel_post_trigger_timer_;
+        if (!is_capturing_ && !is_aborting_) return;
+    }
+    if (is_rle_ && !is_aborting_) {
+        // Completed once core1 has encoded the samples left in the staging ring. Core1 forces the interrupt when done,
+        // so the handler does not wait for it. The capture completes once
+        dma_hw->intf0 = 0;
+        if (!rle_is_done_ || !is_capturing_) return;
+    }
     if (!is_aborting_) {
-        // Set pre trigger range
+        // Set pre trigger range: all the samples in the ring. The window sent is set from the trigger index
         pre_trigger_first_ = 0;
         pre_trigger_count_ = 0;
-        if (pre_trigger_samples_) {
-            uint transfer_count = PRE_TRIGGER_RING_TRANSFER_COUNT - dma_hw->ch[dma_channel_pre_trigger_].transfer_count;
-            pre_trigger_first_ = (int)(transfer_count % PRE_TRIGGER_BUFFER_SIZE) - (int)pre_trigger_samples_;
-            pre_trigger_count_ = pre_trigger_samples_;
-            if ((pre_trigger_first_ < 0) && (transfer_count < PRE_TRIGGER_BUFFER_SIZE)) {
-                pre_trigger_first_ = 0;
-                pre_trigger_count_ = transfer_count;
+        if (pre_trigger_ring_size_) {
+            // The next ring word to write is the oldest one once the ring has wrapped. The reload channel has run (its
+            // raw interrupt flag is set) if the ring has wrapped at least once
+            uint next = (uint)(dma_hw->ch[dma_channel_pre_trigger_].write_addr - (uintptr_t)pre_trigger_buffer_) /
+                        sizeof(uint32_t);
+            bool is_wrapped = dma_hw->intr & (1u << dma_channel_reload_pre_trigger_address_);
+            if (next >= pre_trigger_ring_size_) {
+                next = 0;
+                is_wrapped = true;
+            }
+            pre_trigger_count_ = (is_wrapped ? pre_trigger_ring_size_ : next) << samples_per_word_bits_;
+            pre_trigger_first_ = (int)(next << samples_per_word_bits_) - (int)pre_trigger_count_;
+        }
+        if (is_rle_) {
+            rle_cursor_ = 0;
+            rle_cursor_start_ = 0;
+            debug("\nRLE complete. Samples: %u Runs: %u%s%s", rle_samples_, rle_runs_,
+                  rle_is_overrun_ ? " Overrun" : "", rle_is_full_ ? " Full" : "");
+        }
+        stored_count_ = pre_trigger_count_ + post_trigger_samples_;
+        // The capture state machine stalls if its FIFO is full, which leaves a gap in the samples
+        is_seam_stalled_ = pio0->fdebug & (1u << (PIO_FDEBUG_RXSTALL_LSB + sm_capture_));
+        if (is_transition_)
+            set_transition_range();
+        else
+            set_trigger_index();
+        counters_.samples += stored_count_;
+        counters_.pre_trigger_missing += pre_trigger_samples_ - trigger_index_;
+        if (is_seam_stalled_) {
+            counters_.stalls++;
+            capture_status_ |= CAPTURE_STATUS_STALLED;
+        }
+        if (triggered_channel_ >= 0 && !is_trigger_exact_) capture_status_ |= CAPTURE_STATUS_TRIGGER_ESTIMATED;
+        if (rle_is_overrun_ && is_rle_) capture_status_ |= CAPTURE_STATUS_RLE_OVERRUN;
+        if (rle_is_full_ && is_rle_) capture_status_ |= CAPTURE_STATUS_RLE_FULL;
+        if (is_segmented_) {
+            save_segment(segment_);
+            if (++segment_ < segments_count_) {
+                rearm_segment();
+                return;
             }
+            select_segment(0);
         }
         capture_stop();
         is_capturing_ = false;
+        counters_.trigger_time = time_us_64() - trigger_time_;
         handler_();
     } else {
         is_aborting_ = false;
     }
 }
 
+static inline void set_transition_range(void) {
+    /*
+     * The state machines are stopped. Wait for the post trigger channel to read the FIFO, unless the transitions memory
+     * is full. Transitions after the last sample are not kept. If the memory is full, the capture ends at the last
+     * transition. The capture starts at the trigger, so the trigger is the first sample
+     */
+
+    while (dma_channel_is_busy(dma_channel_post_trigger_) && !pio_sm_is_rx_fifo_empty(pio0, sm_capture_))
+        tight_loop_contents();
+    uint words = (SAMPLE_BUFFER_SIZE & ~1u) - dma_hw->ch[dma_channel_post_trigger_].transfer_count;
+    bool is_full = !dma_hw->ch[dma_channel_post_trigger_].transfer_count;
+    transitions_count_ = words / 2;
+    transition_cursor_ = 0;
+    transition_time_ = 0;
+    while (transitions_count_ && get_transition_first(transitions_count_ - 1) >= post_trigger_samples_)
+        transitions_count_--;
+    stored_count_ = post_trigger_samples_;
+    if (is_full && transitions_count_) {
+        uint64_t last = get_transition_first(transitions_count_ - 1) + 1;
+        if (last < stored_count_) stored_count_ = last;
+        capture_status_ |= CAPTURE_STATUS_TRANSITIONS_FULL;
+    }
+    window_first_ = 0;
+    window_count_ = stored_count_;
+    trigger_index_ = 0;
+    trigger_latency_ = 0;
+    is_trigger_exact_ = true;
+    debug("\nTransition complete. Transitions: %u Samples: %u%s", transitions_count_, stored_count_,
+          is_full ? " Full" : "");
+    if (is_seam_stalled_) debug("\nWarning. Capture stalled. Transition times lost");
+}
+
+static inline void save_segment(uint segment) {
+    segment_t *state = &segment_state_[segment];
+    state->buffer = pre_trigger_buffer_;
+    state->pre_trigger_first = pre_trigger_first_;
+    state->trigger_index = trigger_index_;
+    state->pre_trigger_count = pre_trigger_count_;
+    state->stored_count = stored_count_;
+    state->window_first = window_first_;
+    state->window_count = window_count_;
+    state->trigger_latency = trigger_latency_;
+    state->is_trigger_exact = is_trigger_exact_;
+    state->is_stalled = is_seam_stalled_;
+    state->trigger_time = trigger_time_;
+}
+
+static inline void select_segment(uint segment) {
+    if (segment == segment_selected_) return;
+    segment_t *state = &segment_state_[segment];
+    pre_trigger_buffer_ = state->buffer;
+    post_trigger_buffer_ = &state->buffer[pre_trigger_ring_size_];
+    pre_trigger_first_ = state->pre_trigger_first;
+    trigger_index_ = state->trigger_index;
+    pre_trigger_count_ = state->pre_trigger_count;
+    stored_count_ = state->stored_count;
+    window_first_ = state->window_first;
+    window_count_ = state->window_count;
+    trigger_latency_ = state->trigger_latency;
+    is_trigger_exact_ = state->is_trigger_exact;
+    is_seam_stalled_ = state->is_stalled;
+    segment_selected_ = segment;
+}
+
+static inline void rearm_segment(void) {
+    /*
+     * The stop channel has disabled the pio0 state machines and the programs are still loaded, so the next segment is
+     * armed from the interrupt: the capture and mux state machines restart with empty FIFOs, the pre trigger channel
+     * restarts at the ring of the next segment and the trigger channels are armed again. The trigger state machines
+     * keep running
+     */
+
+    uint32_t *buffer = &sample_buffer_[segment_ * segment_size_];
+
+    // The paused pre trigger channel is aborted chained to itself, so it does not start the reload channel
+    dma_hw->ch[dma_channel_pre_trigger_].al1_ctrl = pre_trigger_abort_ctrl_;
+    dma_channel_abort(dma_channel_pre_trigger_);
+    for (uint i = 0; i < trigger_count_; i++) {
+        dma_channel_abort(dma_channel_trigger_[i]);
+        pio_sm_clear_fifos(pio1, sm_trigger_[i]);
+    }
+    dma_channel_abort(dma_channel_trigger_cycle_);
+    pio_sm_clear_fifos(pio0, sm_capture_);
+    pio_sm_clear_fifos(pio0, sm_mux_);
+    pio_sm_restart(pio0, sm_capture_);
+    pio_sm_exec(pio0, sm_mux_, pio_encode_jmp(offset_mux_));
+    pio0->fdebug = 1u << (PIO_FDEBUG_RXSTALL_LSB + sm_capture_);
+
+    pre_trigger_buffer_ = buffer;
+    post_trigger_buffer_ = &buffer[pre_trigger_ring_size_];
+    pre_trigger_ring_address_ = buffer;
+    segment_selected_ = segment_;
+    triggered_channel_ = -1;
+    dma_hw->intr = 1u << dma_channel_reload_pre_trigger_address_;
+    dma_channel_set_write_addr(dma_channel_trigger_cycle_, trigger_cycle_, false);
+    dma_channel_set_write_addr(dma_channel_post_trigger_, post_trigger_buffer_, false);
+    if (pre_trigger_ring_size_) {
+        dma_channel_set_config(dma_channel_pre_trigger_, &channel_config_pre_trigger_, false);
+        dma_channel_set_trans_count(dma_channel_pre_trigger_, pre_trigger_ring_size_, false);
+        dma_channel_set_write_addr(dma_channel_pre_trigger_, buffer, true);
+    }
+    for (uint i = 0; i < trigger_count_; i++) dma_channel_start(dma_channel_trigger_[i]);
+    dma_channel_start(dma_channel_hand_off_);
+    pio_set_sm_mask_enabled(pio0, (1u << sm_capture_) | (1u << sm_mux_), true);
+}
+
+static inline void stream_block_handler(void) {
+    // Blocks complete in order, alternating between both channels
+    const uint channels[2] = {dma_channel_post_trigger_, dma_channel_post_trigger_stream_};
+    for (uint i = 0; i < 2; i++) {
+        uint channel = channels[(stream_write_block_ + i) % 2];
+        if (!(dma_hw->ints0 & (1u << channel))) continue;
+        dma_hw->ints0 = 1u << channel;
+        if (!is_capturing_) continue;
+        stream_write_block_++;
+        counters_.samples = stream_write_block_ * STREAM_BLOCK_SAMPLES;
+        if (stream_write_block_ >= stream_blocks_total_) {
+            counters_.samples = stream_samples_total_;
+            if (pio0->fdebug & (1u << (PIO_FDEBUG_RXSTALL_LSB + sm_capture_))) {
+                counters_.stalls++;
+                capture_status_ |= CAPTURE_STATUS_STALLED;
+            }
+            capture_stop();
+            is_capturing_ = false;
+        } else if (stream_write_block_ - stream_read_block_ >= STREAM_BLOCK_COUNT - 1) {
+            // The block the channel would be pointed to has not been sent yet. The other channel is already writing the
+            // next block
+            capture_stop();
+            is_capturing_ = false;
+            stream_overrun_ = true;
+            capture_status_ |= CAPTURE_STATUS_STREAM_OVERRUN;
+        } else {
+            dma_channel_set_write_addr(
+                channel, &sample_buffer_[((stream_write_block_ + 1) % STREAM_BLOCK_COUNT) * STREAM_BLOCK_SIZE],
+                false);
+        }
+    }
+}
+
 static inline void trigger_handler(void) {
+    trigger_time_ = time_us_64();
     triggered_channel_ = pio_sm_get(pio0, sm_mux_);
     pio_interrupt_clear(pio0, 0);
 }
 
+static inline void set_trigger_index(void) {
+    /*
+     * The trigger latency is the time from the trigger state machine push to the post trigger channel start. The
+     * samples captured meanwhile are at the end of the pre trigger ring or in the FIFO, so the trigger sample is the
+     * first one matching the trigger from the estimated index to the samples in the FIFO. If the trigger channels are
+     * not captured, the estimated index is used. The window sent has the pre trigger samples before the trigger sample
+     */
+
+    uint stored_count = stored_count_;
+    trigger_index_ = 0;
+    trigger_latency_ = 0;
+    is_trigger_exact_ = false;
+    if (triggered_channel_ >= 0 && triggered_channel_ < (int)trigger_count_) {
+        trigger_t trigger = trigger_set_[triggered_channel_];
+        trigger_latency_ = (seam_cycle_ - trigger_cycle_[0]) & 0xffff;
+        int estimate = (int)pre_trigger_count_ -
+                       (int)((trigger_latency_ + trigger_check_cycles_[triggered_channel_]) / cycles_per_sample_) - 2;
+        trigger_index_ = estimate < 0 ? 0 : estimate;
+        // Protocol triggers match the bus content, not a sample: the estimated index is used
+        if (trigger.match <= TRIGGER_MATCH_EDGE && !(trigger.mask & ~(sample_mask_ << sample_base_))) {
+            uint last = pre_trigger_count_ + ((CAPTURE_FIFO_DEPTH + 1) << samples_per_word_bits_);
+            if (last > stored_count) last = stored_count;
+            bool was_match = !trigger_index_ || is_trigger_match(trigger, get_stored_sample(trigger_index_ - 1));
+            for (uint i = trigger_index_; i < last; i++) {
+                bool is_match = is_trigger_match(trigger, get_stored_sample(i));
+                if (is_match && !was_match) {
+                    trigger_index_ = i;
+                    is_trigger_exact_ = true;
+                    break;
+                }
+                was_match = is_match;
+            }
+        }
+    }
+
+    window_first_ = (uint)trigger_index_ > pre_trigger_samples_ ? trigger_index_ - pre_trigger_samples_ : 0;
+    window_count_ = pre_trigger_samples_ + post_trigger_samples_;
+    if (window_count_ > stored_count - window_first_) window_count_ = stored_count - window_first_;
+    trigger_index_ -= window_first_;
+    if (is_seam_stalled_) debug("\nWarning. Capture stalled. Samples lost");
+}
+
+static inline bool is_trigger_match(trigger_t trigger, uint sample) {
+    return !((sample ^ trigger.value) & trigger.mask);
+}
+
+static void self_test_complete_handler(void) { self_test_is_complete_ = true; }
+
+static inline bool self_test_run(uint rate) {
+    uint pin_edge = pin_base_, pin_clock = pin_base_ + 1;
+    gpio_init(pin_edge);
+    gpio_set_dir(pin_edge, true);
+    gpio_put(pin_edge, false);
+    self_test_is_complete_ = false;
+    pio_capture_start(SELF_TEST_SAMPLES, rate, SELF_TEST_PRE_TRIGGER_SAMPLES);
+
+    // Clock on channel 1. The sys clock is set by the capture start
+    uint clock_period = SELF_TEST_CLOCK_PERIOD * cycles_per_sample_;
+    uint slice = pwm_gpio_to_slice_num(pin_clock);
+    pwm_config config_clock = pwm_get_default_config();
+    pwm_config_set_clkdiv_int(&config_clock, 1);
+    pwm_config_set_wrap(&config_clock, clock_period - 1);
+    pwm_init(slice, &config_clock, false);
+    pwm_set_chan_level(slice, pwm_gpio_to_channel(pin_clock), clock_period / 2);
+    gpio_set_function(pin_clock, GPIO_FUNC_PWM);
+    pwm_set_enabled(slice, true);
+
+    // Edge on channel 0 once the pre trigger samples are captured
+    uint64_t capture_time = (uint64_t)SELF_TEST_SAMPLES * 1000000 / rate;
+    sleep_us((uint64_t)SELF_TEST_PRE_TRIGGER_SAMPLES * 1000000 / rate + 1000);
+    gpio_put(pin_edge, true);
+    uint64_t timeout = time_us_64() + capture_time + 100000;
+    while (!self_test_is_complete_ && time_us_64() < timeout) debug_task();
+    pwm_set_enabled(slice, false);
+    if (!self_test_is_complete_) {
+        pio_capture_abort();
+        debug("\nSelf test. Rate: %u Timeout", rate);
+        return false;
+    }
+
+    // Clock runs, except the first and last ones, must be half a period
+    int index = pio_get_trigger_index();
+    bool is_aligned = is_trigger_exact_ && index == SELF_TEST_PRE_TRIGGER_SAMPLES &&
+                      !(pio_get_sample_index(index - 1) & 0x1) && (pio_get_sample_index(index) & 0x1);
+    uint run = 0, runs = 0, errors = 0;
+    int previous = -1;
+    for (uint i = 0; i < pio_get_samples_count(); i++) {
+        int clock = (pio_get_sample_index(i) >> 1) & 0x1;
+        if (clock == previous) {
+            run++;
+            continue;
+        }
+        if (previous != -1) {
+            if (runs && run != SELF_TEST_CLOCK_PERIOD / 2) errors++;
+            runs++;
+        }
+        previous = clock;
+        run = 1;
+    }
+    bool is_passed = is_aligned && !is_seam_stalled_ && !errors && runs > SELF_TEST_SAMPLES / SELF_TEST_CLOCK_PERIOD;
+    debug("\nSelf test. Rate: %u Trigger index: %d%s Latency: %u Clock runs: %u Errors: %u%s %s", rate, index,
+          is_trigger_exact_ ? "" : " (estimated)", trigger_latency_, runs, errors, is_seam_stalled_ ? " Stalled" : "",
+          is_passed ? "Passed" : "Failed");
+    return is_passed;
+}
+
+static inline bool benchmark_run(uint samples, uint rate, uint clock_samples) {
+    // Untriggered capture. With clock samples, channel 0 outputs a clock of that half period in samples
+    self_test_is_complete_ = false;
+    pio_capture_start(samples, rate, 0);
+    uint slice = pwm_gpio_to_slice_num(pin_base_);
+    if (clock_samples) {
+        uint clock_period = 2 * clock_samples * cycles_per_sample_;
+        pwm_config config_clock = pwm_get_default_config();
+        pwm_config_set_clkdiv_int(&config_clock, 1);
+        pwm_config_set_wrap(&config_clock, clock_period - 1);
+        pwm_init(slice, &config_clock, false);
+        pwm_set_chan_level(slice, pwm_gpio_to_channel(pin_base_), clock_period / 2);
+        gpio_set_function(pin_base_, GPIO_FUNC_PWM);
+        pwm_set_enabled(slice, true);
+    }
+    uint64_t timeout = time_us_64() + (uint64_t)samples * 1000000 / rate + 100000;
+    while (!self_test_is_complete_ && time_us_64() < timeout) debug_task();
+    if (clock_samples) pwm_set_enabled(slice, false);
+    if (!self_test_is_complete_) {
+        pio_capture_abort();
+        return false;
+    }
+    return !(capture_status_ & (CAPTURE_STATUS_STALLED | CAPTURE_STATUS_RLE_OVERRUN | CAPTURE_STATUS_RLE_FULL));
+}
+
 static inline void capture_stop(void) {
-    pio_set_sm_mask_enabled(pio0, (1 << sm_mux_) | (1 << sm_pre_trigger_) | (1 << sm_post_trigger_), false);
+    pio_set_sm_mask_enabled(pio0, (1 << sm_mux_) | (1 << sm_capture_), false);
     pio_set_sm_mask_enabled(pio1, sm_trigger_mask_, false);
+    dma_channel_abort(dma_channel_hand_off_);
+    dma_channel_abort(dma_channel_seam_cycle_);
     dma_channel_abort(dma_channel_pre_trigger_);
+    dma_channel_abort(dma_channel_reload_pre_trigger_address_);
     dma_channel_abort(dma_channel_post_trigger_);
-    dma_channel_abort(dma_channel_pio0_ctrl_);
-    dma_channel_abort(dma_channel_pio1_ctrl_);
+    dma_channel_abort(dma_channel_stop_);
+    if (is_streaming_) {
+        dma_channel_set_irq0_enabled(dma_channel_post_trigger_stream_, false);
+        dma_channel_abort(dma_channel_post_trigger_stream_);
+    }
+    if (is_rle_) multicore_reset_core1();
+    if (is_transition_) dma_channel_set_irq0_enabled(dma_channel_post_trigger_timer_, false);
     for (uint i = 0; i < trigger_count_; i++) {
         dma_channel_abort(dma_channel_trigger_[i]);
         pio_sm_clear_fifos(pio1, sm_trigger_[i]);
     }
+    dma_channel_abort(dma_channel_trigger_cycle_);
     pio_sm_clear_fifos(pio0, sm_mux_);
-    pio_sm_clear_fifos(pio0, sm_pre_trigger_);
-    pio_sm_clear_fifos(pio0, sm_post_trigger_);
+    pio_sm_clear_fifos(pio0, sm_capture_);
+}
+
+static inline void load_programs(const armed_key_t *key) {
+    // Load the capture program patched for the sampled channels, the mux and the trigger programs of the key
     pio_clear_instruction_memory(pio0);
     pio_clear_instruction_memory(pio1);
+    switch (key->program) {
+        case CAPTURE_PROGRAM_EXTERNAL:
+            offset_capture_ = pio_add_program(pio0, &capture_external_program);
+            pio_config_capture_ = capture_external_program_get_default_config(offset_capture_);
+            pio0->instr_mem[offset_capture_] = pio_encode_wait_gpio(key->clock_invert, GPIO_CLOCK_EXTERNAL);
+            pio0->instr_mem[offset_capture_ + 1] = pio_encode_wait_gpio(!key->clock_invert, GPIO_CLOCK_EXTERNAL);
+            pio0->instr_mem[offset_capture_ + 2] = pio_encode_in(pio_pins, key->sample_width);
+            break;
+        case CAPTURE_PROGRAM_TRANSITION:
+            offset_capture_ = pio_add_program(pio0, &capture_transition_program);
+            pio_config_capture_ = capture_transition_program_get_default_config(offset_capture_);
+            pio0->instr_mem[offset_capture_ + 1] = pio_encode_in(pio_pins, key->sample_width);
+            break;
+        case CAPTURE_PROGRAM_LOOP:
+            offset_capture_ = pio_add_program(pio0, &capture_loop_program);
+            pio_config_capture_ = capture_loop_program_get_default_config(offset_capture_);
+            pio0->instr_mem[offset_capture_] = pio_encode_in(pio_pins, key->sample_width);
+            break;
+        default:
+            offset_capture_ = pio_add_program(pio0, &capture_program);
+            pio_config_capture_ = capture_program_get_default_config(offset_capture_);
+            pio0->instr_mem[offset_capture_] = pio_encode_in(pio_pins, key->sample_width);
+            break;
+    }
+    // Transition: the value is read to the least significant bits and pushed by the program
+    bool is_transition = key->program == CAPTURE_PROGRAM_TRANSITION;
+    sm_config_set_in_pins(&pio_config_capture_, key->sample_base);
+    sm_config_set_in_shift(&pio_config_capture_, !is_transition, !is_transition, 32);
+    sm_config_set_clkdiv_int_frac(&pio_config_capture_,
+                                  key->program == CAPTURE_PROGRAM_LOOP || is_transition ? 1 : key->cycles_per_sample,
+                                  0);
+
+    offset_mux_ = pio_add_program(pio0, &mux_program);
+    pio_config_mux_ = mux_program_get_default_config(offset_mux_);
+    sm_config_set_clkdiv(&pio_config_mux_, 1);
+
+    trigger_count_ = 0;
+    sm_trigger_mask_ = 0;
+    for (uint i = 0; i < MAX_TRIGGER_COUNT && key->trigger[i].is_enabled; i++) load_trigger(key->trigger[i]);
 }
 
-static inline bool set_trigger(trigger_t trigger) {
-    if (trigger_count_ < MAX_TRIGGER_COUNT) {
-        switch (trigger.match) {
-            case TRIGGER_TYPE_LEVEL_HIGH:
-                offset_trigger_[trigger_count_] = pio_add_program(pio1, &trigger_level_high_program);
-                pio_config_trigger_[trigger_count_] =
-                    trigger_level_high_program_get_default_config(offset_trigger_[trigger_count_]);
-                break;
-            case TRIGGER_TYPE_LEVEL_LOW:
-                offset_trigger_[trigger_count_] = pio_add_program(pio1, &trigger_level_low_program);
-                pio_config_trigger_[trigger_count_] =
-                    trigger_level_low_program_get_default_config(offset_trigger_[trigger_count_]);
-                break;
-            case TRIGGER_TYPE_EDGE_HIGH:
-                offset_trigger_[trigger_count_] = pio_add_program(pio1, &trigger_edge_high_program);
-                pio_config_trigger_[trigger_count_] =
-                    trigger_edge_high_program_get_default_config(offset_trigger_[trigger_count_]);
-                break;
-            case TRIGGER_TYPE_EDGE_LOW:
-                offset_trigger_[trigger_count_] = pio_add_program(pio1, &trigger_edge_low_program);
-                pio_config_trigger_[trigger_count_] =
-                    trigger_edge_low_program_get_default_config(offset_trigger_[trigger_count_]);
-                break;
+static inline bool load_trigger(trigger_t trigger) {
+    if (trigger_count_ >= MAX_TRIGGER_COUNT || !trigger.mask) return false;
+
+    uint index = trigger_count_, wrap_target, wrap, cycles;
+    bool is_protocol = trigger.match >= TRIGGER_MATCH_UART;
+    trigger_program_[index].instructions = trigger_instructions_[index];
+    trigger_program_[index].length =
+        is_protocol ? compile_protocol_trigger(trigger, trigger_instructions_[index], &trigger_value_[index],
+                                               &wrap_target, &wrap, &cycles)
+                    : compile_trigger(trigger, trigger_instructions_[index], &trigger_value_[index], &wrap_target,
+                                      &wrap, &cycles);
+    trigger_program_[index].origin = -1;
+    if (!trigger_program_[index].length || !pio_can_add_program(pio1, &trigger_program_[index])) {
+        debug_block("\n-Trigger %u ignored. Mask: 0x%04X. Not enough PIO instruction memory", index, trigger.mask);
+        return false;
+    }
+    offset_trigger_[index] = pio_add_program(pio1, &trigger_program_[index]);
+
+    // One pattern check every sample if the program is fast enough. Protocol triggers follow the bus: the UART program
+    // runs at 8 cycles per bit, the SPI and I2C programs wait for the clock edges at the sys clock
+    uint clk_div = cycles_per_sample_ / cycles, clk_frac = 0;
+    if (trigger.match == TRIGGER_MATCH_UART) {
+        uint64_t div = ((uint64_t)clock_get_hz(clk_sys) * 256 / UART_TRIGGER_BIT_CYCLES + trigger.baud_rate / 2) /
+                       (trigger.baud_rate ? trigger.baud_rate : 1);
+        clk_div = div >> 8;
+        clk_frac = div & 0xff;
+    } else if (is_protocol) {
+        clk_div = 1;
+    }
+    if (clk_div < 1 || clk_div > 0xffff) {
+        clk_div = clk_div < 1 ? 1 : 0xffff;
+        clk_frac = 0;
+    }
+    pio_config_trigger_[index] = pio_get_default_sm_config();
+    sm_config_set_wrap(&pio_config_trigger_[index], offset_trigger_[index] + wrap_target,
+                       offset_trigger_[index] + wrap);
+    // Protocol triggers read the data channel. UART bits are shifted to the right, least significant bit first
+    uint in_pin = __builtin_ctz(trigger.mask);
+    if (is_protocol) in_pin = trigger.match == TRIGGER_MATCH_UART ? trigger.channel[0] : trigger.channel[1];
+    sm_config_set_in_pins(&pio_config_trigger_[index], in_pin);
+    sm_config_set_in_shift(&pio_config_trigger_[index], trigger.match == TRIGGER_MATCH_UART, false, 32);
+    sm_config_set_out_shift(&pio_config_trigger_[index], true, false, 32);
+    if (trigger.match == TRIGGER_MATCH_I2C) sm_config_set_jmp_pin(&pio_config_trigger_[index], trigger.channel[0]);
+    sm_config_set_clkdiv_int_frac(&pio_config_trigger_[index], clk_div, clk_frac);
+    sm_trigger_mask_ |= 1 << sm_trigger_[index];
+
+    debug_block("\n-Load trigger %u Mask: 0x%04X Value: 0x%04X Match: %s Program: %u Check cycles: %u Clk div: %u",
+                index, trigger.mask, is_protocol ? trigger.value : trigger.value & trigger.mask,
+                trigger_match_name_[trigger.match], trigger_program_[index].length, cycles, clk_div);
+
+    trigger_set_[index] = trigger;
+    trigger_check_cycles_[index] = cycles * clk_div;
+    trigger_count_++;
+    return true;
+}
+
+static inline void arm_trigger(uint index) {
+    pio_sm_init(pio1, sm_trigger_[index], offset_trigger_[index], &pio_config_trigger_[index]);
+
+    // Expected value to Y
+    pio_sm_put(pio1, sm_trigger_[index], trigger_value_[index]);
+    pio_sm_exec(pio1, sm_trigger_[index], pio_encode_pull(false, true));
+    pio_sm_exec(pio1, sm_trigger_[index], pio_encode_mov(pio_y, pio_osr));
+
+    // The trigger time is copied by the cycle snapshot channel. The first trigger is in the first position
+    dma_channel_config channel_config_trigger = dma_channel_get_default_config(dma_channel_trigger_[index]);
+    channel_config_set_transfer_data_size(&channel_config_trigger, DMA_SIZE_32);
+    channel_config_set_write_increment(&channel_config_trigger, false);
+    channel_config_set_read_increment(&channel_config_trigger, false);
+    channel_config_set_dreq(&channel_config_trigger, pio_get_dreq(pio1, sm_trigger_[index], false));
+    channel_config_set_chain_to(&channel_config_trigger, dma_channel_trigger_cycle_);
+    dma_channel_configure(dma_channel_trigger_[index], &channel_config_trigger,
+                          &pio0->txf[sm_mux_],               // write address
+                          &triggered_channel_index_[index],  // read address
+                          1, true);
+}
+
+static inline uint compile_trigger(trigger_t trigger, uint16_t *program, uint32_t *value, uint *wrap_target,
+                                   uint *wrap, uint *cycles) {
+    /*
+     * Generate a program that reads all the channels in the mask at once and compares them with the expected value in
+     * Y. Pins are read from the lowest channel in the mask. Each run of contiguous channels in the mask is shifted
+     * into the ISR:
+     *
+     *   mov isr, null
+     *   in pins, n0                 (single run)
+     *   mov osr, pins               (several runs: skip the gaps between runs)
+     *   in osr, n0
+     *   out null, n0 + gap1
+     *   in osr, n1
+     *   ...
+     *   mov x, isr
+     *   jmp x!=y <check>
+     *
+     * Level: push when the check matches. Edge: check until it does not match, then check until it matches and push.
+     * Returns the program length (0 if it does not fit) and the cycles of one check
+     */
+
+    uint16_t check[PIO_INSTRUCTION_COUNT];
+    uint check_length = 0, mask = trigger.mask >> __builtin_ctz(trigger.mask),
+         expected = trigger.value >> __builtin_ctz(trigger.mask), isr = 0;
+    check[check_length++] = pio_encode_mov(pio_isr, pio_null);
+    if (!(mask & (mask + 1))) {
+        uint count = 32 - __builtin_clz(mask);
+        check[check_length++] = pio_encode_in(pio_pins, count);
+        isr = expected & mask;
+    } else {
+        check[check_length++] = pio_encode_mov(pio_osr, pio_pins);
+        uint position = 0;
+        while (true) {
+            uint count = __builtin_ctz(~(mask >> position));
+            check[check_length++] = pio_encode_in(pio_osr, count);
+            isr = (isr << count) | ((expected >> position) & ((1u << count) - 1));
+            if (!(mask >> (position + count))) break;
+            // Skip the run just read and the gap to the next run
+            uint skip = count + __builtin_ctz(mask >> (position + count));
+            check[check_length++] = pio_encode_out(pio_null, skip);
+            position += skip;
         }
-        sm_config_set_clkdiv(&pio_config_trigger_[trigger_count_], clk_div_);
-        sm_config_set_in_pins(&pio_config_trigger_[trigger_count_], trigger.pin);
-        pio_sm_init(pio1, sm_trigger_[trigger_count_], offset_trigger_[trigger_count_],
-                    &pio_config_trigger_[trigger_count_]);
-        sm_trigger_mask_ |= 1 << sm_trigger_[trigger_count_];
-
-        dma_channel_config channel_config_trigger =
-            dma_channel_get_default_config(dma_channel_trigger_[trigger_count_]);
-        channel_config_set_transfer_data_size(&channel_config_trigger, DMA_SIZE_32);
-        channel_config_set_write_increment(&channel_config_trigger, false);
-        channel_config_set_read_increment(&channel_config_trigger, false);
-        channel_config_set_dreq(&channel_config_trigger, pio_get_dreq(pio1, sm_trigger_[trigger_count_], false));
-        dma_channel_configure(dma_channel_trigger_[trigger_count_], &channel_config_trigger,
-                              &pio0->txf[sm_mux_],                        // write address
-                              &triggered_channel_index_[trigger_count_],  // read address
-                              1, true);
-
-        if (debug_is_enabled()) {
-            char match[15] = "";
-            switch (capture_config_.trigger[trigger_count_].match) {
-                case TRIGGER_TYPE_LEVEL_HIGH:
-                    strcpy(match, "Level High");
-                    break;
-                case TRIGGER_TYPE_LEVEL_LOW:
-                    strcpy(match, "Level Low");
-                    break;
-                case TRIGGER_TYPE_EDGE_HIGH:
-                    strcpy(match, "Edge High");
-                    break;
-                case TRIGGER_TYPE_EDGE_LOW:
-                    strcpy(match, "Edge Low");
-                    break;
-            }
-            debug_block("\n-Set trigger %u Pin: %u Match: %s %s", trigger_count_,
-                        capture_config_.trigger[trigger_count_].pin, match, config_.trigger_edge ? "(override)" : "");
+    }
+    check[check_length++] = pio_encode_mov(pio_x, pio_isr);
+    *value = isr;
+    *cycles = check_length + 1;
+
+    uint length = 0;
+    if (trigger.match == TRIGGER_MATCH_LEVEL) {
+        if (check_length + 2 > PIO_INSTRUCTION_COUNT) return 0;
+        for (uint i = 0; i < check_length; i++) program[length++] = check[i];
+        program[length++] = pio_encode_jmp_x_ne_y(0);
+        program[length++] = pio_encode_push(false, false);
+        *wrap_target = 0;
+        *wrap = length - 1;
+    } else {
+        if (2 * check_length + 4 > PIO_INSTRUCTION_COUNT) return 0;
+        uint match = check_length + 1;
+        for (uint i = 0; i < check_length; i++) program[length++] = check[i];
+        program[length++] = pio_encode_jmp_x_ne_y(match);
+        for (uint i = 0; i < check_length; i++) program[length++] = check[i];
+        program[length++] = pio_encode_jmp_x_ne_y(match);
+        program[length++] = pio_encode_push(false, false);
+        program[length++] = pio_encode_jmp(0);
+        *wrap_target = 0;
+        *wrap = match - 1;
+    }
+    return length;
+}
+
+static inline uint compile_protocol_trigger(trigger_t trigger, uint16_t *program, uint32_t *value, uint *wrap_target,
+                                            uint *wrap, uint *cycles) {
+    /*
+     * Generate a program that deserializes the bus and compares each byte (I2C: the address) with the expected value
+     * in Y. UART, 8 cycles per bit, data bits shifted to the ISR most significant bits:
+     *
+     *   wait 0 gpio rx                 start bit
+     *   set x, 7 [10]                  to the middle of the first data bit
+     *   in pins, 1                     data bit
+     *   jmp x-- <in> [6]
+     *   <compare>
+     *   wait 1 gpio rx                 stop bit
+     *
+     * SPI, data read at the sampling edge of the mode. With the chip select, the first byte starts at its assertion:
+     *
+     *   wait 1 gpio cs                 (chip select)
+     *   wait 0 gpio cs                 (chip select)
+     *   set x, 7
+     *   wait !edge gpio clock
+     *   wait edge gpio clock
+     *   in pins, 1
+     *   jmp x-- <wait>
+     *   <compare>
+     *
+     * I2C, the 7 address bits after a start (SDA falling while SCL is high), read at the SCL rising edges:
+     *
+     *   wait 1 gpio sda
+     *   wait 0 gpio sda
+     *   jmp pin <set>                  SCL high: start
+     *   jmp 0
+     *   set x, 6
+     *   wait 0 gpio scl
+     *   wait 1 gpio scl
+     *   in pins, 1
+     *   jmp x-- <wait>
+     *   <compare>
+     *
+     * Compare: mov x, isr / mov isr, null / jmp x!=y <next> / push. Returns the program length and the cycles from the
+     * last bit read to the push
+     */
+
+    uint length = 0, clock = trigger.channel[0], data = trigger.channel[1], select = trigger.channel[2];
+    uint bit, next;
+    *wrap_target = 0;
+    if (trigger.match == TRIGGER_MATCH_UART) {
+        program[length++] = pio_encode_wait_gpio(false, clock);
+        program[length++] = pio_encode_set(pio_x, 7) | pio_encode_delay(UART_TRIGGER_BIT_CYCLES + 2);
+        bit = length;
+        program[length++] = pio_encode_in(pio_pins, 1);
+        program[length++] = pio_encode_jmp_x_dec(bit) | pio_encode_delay(UART_TRIGGER_BIT_CYCLES - 2);
+        next = length + 4;
+        *value = (trigger.value & 0xff) << 24;
+    } else if (trigger.match == TRIGGER_MATCH_SPI) {
+        // Sampling edge: rising when the clock polarity and phase are equal (modes 0 and 3)
+        bool edge = !(((trigger.spi_mode >> 1) ^ trigger.spi_mode) & 1);
+        if (select != TRIGGER_CHANNEL_NONE) {
+            program[length++] = pio_encode_wait_gpio(true, select);
+            program[length++] = pio_encode_wait_gpio(false, select);
         }
+        *wrap_target = length;
+        next = length;
+        program[length++] = pio_encode_set(pio_x, 7);
+        bit = length;
+        program[length++] = pio_encode_wait_gpio(!edge, clock);
+        program[length++] = pio_encode_wait_gpio(edge, clock);
+        program[length++] = pio_encode_in(pio_pins, 1);
+        program[length++] = pio_encode_jmp_x_dec(bit);
+        *value = trigger.value & 0xff;
+    } else {
+        program[length++] = pio_encode_wait_gpio(true, data);
+        program[length++] = pio_encode_wait_gpio(false, data);
+        program[length++] = pio_encode_jmp_pin(4);
+        program[length++] = pio_encode_jmp(0);
+        program[length++] = pio_encode_set(pio_x, 6);
+        bit = length;
+        program[length++] = pio_encode_wait_gpio(false, clock);
+        program[length++] = pio_encode_wait_gpio(true, clock);
+        program[length++] = pio_encode_in(pio_pins, 1);
+        program[length++] = pio_encode_jmp_x_dec(bit);
+        next = 0;
+        *value = trigger.value & 0x7f;
+    }
+    program[length++] = pio_encode_mov(pio_x, pio_isr);
+    program[length++] = pio_encode_mov(pio_isr, pio_null);
+    program[length++] = pio_encode_jmp_x_ne_y(next);
+    program[length++] = pio_encode_push(false, false);
+    if (trigger.match == TRIGGER_MATCH_UART) program[length++] = pio_encode_wait_gpio(true, clock);
+    *wrap = length - 1;
+    *cycles = trigger.match == TRIGGER_MATCH_UART ? UART_TRIGGER_BIT_CYCLES + 3 : 5;
+    return length;
+}
+
+static inline uint get_sample_width(uint channel_mask, uint *sample_base) {
+    /*
+     * Capture only the channels from the lowest to the highest enabled channel, rounded up to a power of two width
+     * (1, 2, 4, 8 or 16 bits). Samples are packed in 32 bit words, first sample in the least significant bits. Up to 16
+     * bits the channels are read from contiguous GPIOs. Channels 16 to 25, or more than 16 channels, are captured as
+     * 32 bit samples of GPIO 0-31
+     */
+
+    channel_mask &= (1u << pin_count_) - 1;
+    if (!channel_mask) channel_mask = (1u << pin_count_) - 1;
+    uint base = __builtin_ctz(channel_mask);
+    uint span = 32 - __builtin_clz(channel_mask) - base;
+    uint width = 1;
+    while (width < span) width <<= 1;
+    uint last = pin_count_ < CHANNEL_GPIO_CONTIGUOUS ? pin_count_ : CHANNEL_GPIO_CONTIGUOUS;
+    if (width > 16 || base + span > last) {
+        width = 32;
+        base = 0;
+    } else if (base + width > last) {
+        base = last - width;
+    }
+    *sample_base = base;
+    return width;
+}
+
+static inline uint get_width_rle_max_rate(uint width_index) {
+    return is_benchmarked_ ? benchmark_rle_max_rate_[width_index] : rle_max_rate_[width_index];
+}
+
+static inline uint get_channel_gpio(uint channel) { return channel < CHANNEL_COUNT ? channel_gpio_[channel] : channel; }
+
+static inline uint32_t get_gpio_mask(uint32_t channel_mask) {
+    return (channel_mask & 0xffff) | ((channel_mask & (7u << 16)) << 4) | ((channel_mask & (7u << 19)) << 7) |
+           ((channel_mask & (3u << 22)) >> 4) | ((channel_mask & (3u << 24)) >> 8);
+}
+
+static inline void set_channel_order(uint32_t *words, uint count) {
+    // One 32 bit sample per word. Trigger indexes are found before, with the trigger masks in GPIO order
+    for (uint i = 0; i < count; i++) words[i] = get_channel_value(words[i]);
+}
+
+static inline uint32_t get_channel_value(uint32_t gpio_value) {
+    // GPIOs that are not channels of this capture read as low
+    gpio_value &= channel_gpio_mask_;
+    return (gpio_value & 0xffff) | ((gpio_value >> 4) & (7u << 16)) | ((gpio_value >> 7) & (7u << 19)) |
+           ((gpio_value << 4) & (3u << 22)) | ((gpio_value << 8) & (3u << 24));
+}
+
+static inline uint32_t get_channel_gpio_mask(void) {
+    // GPIO 16 and 17 are channels unless they carry the debug output or the external clock
+    uint32_t mask = get_gpio_mask((1u << pin_count_) - 1) & CHANNEL_GPIO_MASK;
+    if (gpio_get_function(GPIO_DEBUG_OUTPUT) == GPIO_FUNC_UART) mask &= ~(1u << GPIO_DEBUG_OUTPUT);
+    if (is_clock_external_) mask &= ~(1u << GPIO_CLOCK_EXTERNAL);
+    return mask;
+}
+
+static inline void set_gpio_inputs_masked(bool is_masked) {
+    /*
+     * 32 bit transition captures compare the whole GPIO value, and PIO has no AND to mask it. The GPIOs that are not
+     * channels read as low while they are captured, so only the channels start a transition. The override only
+     * changes what the peripherals read: the debug output is not affected, and the external clock is not read during
+     * a transition capture
+     */
 
-        trigger_count_++;
-        return true;
+    for (uint gpio = 0; gpio < NUM_BANK0_GPIOS; gpio++)
+        if (!(channel_gpio_mask_ & (1u << gpio)))
+            gpio_set_inover(gpio, is_masked ? GPIO_OVERRIDE_LOW : GPIO_OVERRIDE_NORMAL);
+}
+
+static inline uint get_stored_sample(uint index) {
+    // Pre trigger ring samples first, then post trigger samples
+    if (index >= stored_count_) return 0;
+
+    if (index < pre_trigger_count_) {
+        int pos = pre_trigger_first_ + (int)index;
+        int ring_size = pre_trigger_ring_size_ << samples_per_word_bits_;
+
+        if (pos < 0)
+            pos += ring_size;
+        else if (pos >= ring_size)
+            pos -= ring_size;
+
+        return get_sample(pre_trigger_buffer_, pos);
+    }
+
+    if (is_rle_) return get_rle_sample(index - pre_trigger_count_);
+    if (is_transition_) return get_transition_sample(index);
+    return get_sample(post_trigger_buffer_, index - pre_trigger_count_);
+}
+
+static inline uint get_sample(const uint32_t *buffer, uint index) {
+    uint word = buffer[index >> samples_per_word_bits_];
+    uint shift = (index & ((1u << samples_per_word_bits_) - 1)) * sample_width_;
+    return ((word >> shift) & sample_mask_) << sample_base_;
+}
+
+static inline uint get_rle_sample(uint index) {
+    // Runs are read sequentially, so the cursor moves one run at a time
+    if (index >= rle_samples_) return 0;
+    while (index < rle_cursor_start_) {
+        rle_cursor_--;
+        rle_cursor_start_ -= (post_trigger_buffer_[rle_cursor_] >> 16) + 1;
     }
-    return false;
-}
\ No newline at end of file
+    while (index > rle_cursor_start_ + (post_trigger_buffer_[rle_cursor_] >> 16)) {
+        rle_cursor_start_ += (post_trigger_buffer_[rle_cursor_] >> 16) + 1;
+        rle_cursor_++;
+    }
+    return (post_trigger_buffer_[rle_cursor_] & 0xffff) << sample_base_;
+}
+
+static inline uint get_transition_sample(uint index) {
+    // Value of the last transition up to the sample. Samples are read sequentially, so the cursor moves one transition
+    // at a time
+    if (!transitions_count_) return 0;
+    uint transition = transition_cursor_;
+    while (transition && get_transition_first(transition) > index) transition--;
+    while (transition + 1 < transitions_count_ && get_transition_first(transition + 1) <= index) transition++;
+    return get_transition_value(transition);
+}
+
+static inline uint get_transition_value(uint index) {
+    uint32_t value = post_trigger_buffer_[2 * index];
+    return sample_width_ == 32 ? get_channel_value(value) : value << sample_base_;
+}
+
+static inline uint64_t get_transition_time(uint index) {
+    // The cursor time is updated one transition at a time. The first transition is at the capture start
+    while (transition_cursor_ < index) transition_time_ += get_transition_cycles(++transition_cursor_);
+    while (transition_cursor_ > index) transition_time_ -= get_transition_cycles(transition_cursor_--);
+    return transition_time_;
+}
+
+static inline uint64_t get_transition_cycles(uint index) {
+    // Time from the previous transition: the loops counted down from 0xffffffff and the loops of the push
+    return ((uint64_t)(uint32_t)~post_trigger_buffer_[2 * index + 1] + TRANSITION_PUSH_LOOPS) * TRANSITION_LOOP_CYCLES;
+}
+
+static inline uint64_t get_transition_first(uint index) {
+    // First sample at or after the transition
+    return (get_transition_time(index) + cycles_per_sample_ - 1) / cycles_per_sample_;
+}
+
+static void __not_in_flash_func(rle_encoder)(void) {
+    /*
+     * Core1: encode the raw samples of the staging ring as they are captured. Each run is stored in a word: sample
+     * value in the 16 least significant bits and run length - 1 in the 16 most significant bits. Words with all the
+     * samples equal to the current run are counted at once
+     */
+
+    const volatile uint32_t *staging = sample_buffer_;
+    uint32_t *run = post_trigger_buffer_, *run_end = post_trigger_buffer_ + rle_buffer_size_;
+    const uint samples_per_word = 1u << samples_per_word_bits_, width = sample_width_, mask = sample_mask_,
+               replicate = 0xffffffffu / sample_mask_;
+    uint consumed = 0, value = 0, count = 0, samples = 0;
+    uint32_t value_word = 0;
+
+    while (consumed < rle_words_total_) {
+        uint first = consumed;
+        uint produced = rle_words_total_ - dma_hw->ch[dma_channel_post_trigger_].transfer_count;
+        while (consumed < produced) {
+            uint32_t word = staging[consumed & (RLE_STAGING_SIZE - 1)];
+            consumed++;
+            if (word == value_word && count + samples_per_word <= RLE_MAX_RUN_LENGTH) {
+                count += samples_per_word;
+                continue;
+            }
+            for (uint i = 0; i < samples_per_word; i++) {
+                uint sample = word & mask;
+                word >>= width;
+                if (sample == value && count && count < RLE_MAX_RUN_LENGTH) {
+                    count++;
+                    continue;
+                }
+                if (count) {
+                    if (run == run_end) {
+                        rle_is_full_ = true;
+                        count = 0;
+                        goto done;
+                    }
+                    *run++ = value | ((count - 1) << 16);
+                    samples += count;
+                }
+                value = sample;
+                value_word = value * replicate;
+                count = 1;
+            }
+        }
+        // Staging words overwritten before being read
+        if (rle_words_total_ - dma_hw->ch[dma_channel_post_trigger_].transfer_count - first > RLE_STAGING_SIZE) {
+            rle_is_overrun_ = true;
+            count = 0;
+            break;
+        }
+    }
+    if (count && run < run_end) {
+        *run++ = value | ((count - 1) << 16);
+        samples += count;
+    }
+done:
+    rle_samples_ = samples;
+    rle_runs_ = run - post_trigger_buffer_;
+    rle_is_done_ = true;
+    // Complete the capture on core0. Core1 has not enabled the DMA interrupt
+    __dmb();
+    dma_hw->intf0 = 1u << dma_channel_post_trigger_;
+}
+
+const capture_backend_t capture_backend_pio = {.name = "pio",
+                                               .init = pio_capture_init,
+                                               .start = pio_capture_start,
+                                               .abort = pio_capture_abort,
+                                               .is_busy = pio_capture_is_busy,
+                                               .get_sample_index = pio_get_sample_index,
+                                               .get_samples_count = pio_get_samples_count,
+                                               .prepare_read = pio_prepare_read,
+                                               .get_capture_rate = pio_get_capture_rate,
+                                               .get_capture_spans = pio_get_capture_spans,
+                                               .get_max_samples = pio_get_max_samples,
+                                               .get_rle_max_rate = pio_get_rle_max_rate,
+                                               .stream_get_block = pio_capture_stream_get_block,
+                                               .stream_release_block = pio_capture_stream_release_block,
+                                               .stream_is_overrun = pio_capture_stream_is_overrun,
+                                               .get_pre_trigger_count = pio_get_pre_trigger_count,
+                                               .get_triggered_channel = pio_get_triggered_channel,
+                                               .get_trigger_index = pio_get_trigger_index,
+                                               .get_trigger_latency = pio_get_trigger_latency,
+                                               .get_segments_count = pio_get_segments_count,
+                                               .get_segment_time = pio_get_segment_time,
+                                               .get_capture_status = pio_get_capture_status,
+                                               .get_max_rate = pio_get_max_rate,
+                                               .benchmark = pio_capture_benchmark,
+                                               .self_test = pio_capture_self_test,
+                                               .get_transitions_count = pio_get_transitions_count,
+                                               .get_transition = pio_get_transition};
@@ -25,19 +25,112 @@ extern "C" {
 
 #include "common.h"
 
+// Max number of spans of a capture: pre trigger ring tail and head, and post trigger samples
+#define CAPTURE_SPANS_MAX 3
+
+// Max number of segments of a segmented capture
+#define CAPTURE_SEGMENTS_MAX 64
+
+// Sample widths: 1, 2, 4, 8, 16 and 32 bits
+#define CAPTURE_WIDTHS_COUNT 6
+
+// Status of the last capture
+#define CAPTURE_STATUS_STALLED (1 << 0)            // the capture FIFO was full: samples were lost
+#define CAPTURE_STATUS_STREAM_OVERRUN (1 << 1)     // the host did not read the stream fast enough
+#define CAPTURE_STATUS_RLE_OVERRUN (1 << 2)        // the RLE encoder did not keep up with the capture
+#define CAPTURE_STATUS_RLE_FULL (1 << 3)           // the RLE run memory filled up
+#define CAPTURE_STATUS_TRIGGER_ESTIMATED (1 << 4)  // the trigger sample was estimated from the latency
+#define CAPTURE_STATUS_TRANSITIONS_FULL (1 << 5)   // the transitions memory filled up
+#define CAPTURE_STATUS_MODE_REJECTED (1 << 6)      // the stream or RLE rate was too high: captured as one shot
+
 typedef void (*complete_handler_t)(void);
 
+// Contiguous samples of a capture. Samples are packed in 32 bit words, first sample in the least significant bits
+typedef struct capture_span_t {
+    const uint32_t *buffer;
+    uint first;  // index of the first sample in the buffer
+    uint count;
+    uint width;  // sample width: 1, 2, 4, 8, 16 or 32 bits
+    uint base;   // channel of the sample least significant bit
+} capture_span_t;
+
+// Change of the channels of a transition capture. The first transition is the value at the capture start
+typedef struct capture_transition_t {
+    uint value;
+    uint sample;    // first sample with this value at the capture rate
+    uint64_t time;  // sys clock cycles from the capture start
+} capture_transition_t;
+
+/*
+ * Capture backend. The functions below call the selected backend. Optional functions may be NULL: their calls return
+ * 0 (-1 for the trigger)
+ */
+typedef struct capture_backend_t {
+    const char *name;
+    void (*init)(uint pin_base, uint pin_count, complete_handler_t handler);
+    void (*start)(uint samples, uint rate, uint pre_trigger_samples);
+    void (*abort)(void);
+    bool (*is_busy)(void);
+    uint (*get_sample_index)(int index);
+    uint (*get_samples_count)(void);
+    void (*prepare_read)(void);  // optional
+    uint (*get_capture_rate)(void);
+    uint (*get_capture_spans)(capture_span_t spans[CAPTURE_SPANS_MAX]);
+    uint (*get_max_samples)(uint channel_mask, capture_mode_t mode);
+    uint (*get_rle_max_rate)(uint channel_mask);  // optional
+    uint (*stream_get_block)(const uint16_t **samples);
+    void (*stream_release_block)(void);
+    bool (*stream_is_overrun)(void);
+    uint (*get_pre_trigger_count)(void);
+    int (*get_triggered_channel)(void);                       // optional
+    int (*get_trigger_index)(void);                           // optional
+    uint (*get_trigger_latency)(void);                        // optional
+    uint (*get_segments_count)(void);                         // optional
+    uint32_t (*get_segment_time)(uint segment);               // optional
+    uint (*get_capture_status)(void);                         // optional
+    uint (*get_max_rate)(uint channel_mask);                  // optional
+    uint (*benchmark)(uint max_rates[CAPTURE_WIDTHS_COUNT], uint rle_max_rates[CAPTURE_WIDTHS_COUNT]);  // optional
+    uint (*self_test)(void);                                  // optional
+    // Transition captures. Optional
+    uint (*get_transitions_count)(void);
+    bool (*get_transition)(uint index, capture_transition_t *transition);
+} capture_backend_t;
+
+// PIO and DMA capture of the firmware
+extern const capture_backend_t capture_backend_pio;
+
 extern capture_config_t capture_config_;
 extern config_t config_;
+extern counters_t counters_;
 
+void capture_set_backend(const capture_backend_t *backend);
+const capture_backend_t *capture_get_backend(void);
 void capture_init(uint pin_base, uint pin_count, complete_handler_t handler);
 void capture_start(uint samples, uint rate, uint pre_trigger_samples);
 void capture_abort(void);
 bool capture_is_busy(void);
 uint get_sample_index(int index);
 uint get_samples_count(void);
+void capture_prepare_read(void);
+uint get_capture_rate(void);
+uint get_capture_spans(capture_span_t spans[CAPTURE_SPANS_MAX]);
+uint get_max_samples(uint channel_mask, capture_mode_t mode);
+uint get_rle_max_rate(uint channel_mask);
+uint capture_stream_get_block(const uint16_t **samples);
+void capture_stream_release_block(void);
+bool capture_stream_is_overrun(void);
 uint get_pre_trigger_count(void);
 int get_triggered_channel(void);
+int get_trigger_index(void);
+uint get_trigger_latency(void);
+uint get_segments_count(void);
+uint32_t get_segment_time(uint segment);
+uint get_capture_status(void);
+uint get_max_rate(uint channel_mask);
+uint capture_benchmark(uint max_rates[CAPTURE_WIDTHS_COUNT], uint rle_max_rates[CAPTURE_WIDTHS_COUNT]);
+uint capture_self_test(void);
+uint get_transitions_count(void);
+bool get_transition(uint index, capture_transition_t *transition);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,96 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Capture functions of capture.h, calling the selected backend
+
+#include "capture.h"
+
+static const capture_backend_t *backend_ = NULL;
+
+void capture_set_backend(const capture_backend_t *backend) { backend_ = backend; }
+
+const capture_backend_t *capture_get_backend(void) { return backend_; }
+
+void capture_init(uint pin_base, uint pin_count, complete_handler_t handler) {
+    backend_->init(pin_base, pin_count, handler);
+}
+
+void capture_start(uint samples, uint rate, uint pre_trigger_samples) {
+    backend_->start(samples, rate, pre_trigger_samples);
+}
+
+void capture_abort(void) { backend_->abort(); }
+
+bool capture_is_busy(void) { return backend_->is_busy(); }
+
+uint get_sample_index(int index) { return backend_->get_sample_index(index); }
+
+uint get_samples_count(void) { return backend_->get_samples_count(); }
+
+void capture_prepare_read(void) {
+    if (backend_->prepare_read) backend_->prepare_read();
+}
+
+uint get_capture_rate(void) { return backend_->get_capture_rate(); }
+
+uint get_capture_spans(capture_span_t spans[CAPTURE_SPANS_MAX]) { return backend_->get_capture_spans(spans); }
+
+uint get_max_samples(uint channel_mask, capture_mode_t mode) { return backend_->get_max_samples(channel_mask, mode); }
+
+uint get_rle_max_rate(uint channel_mask) {
+    return backend_->get_rle_max_rate ? backend_->get_rle_max_rate(channel_mask) : 0;
+}
+
+uint capture_stream_get_block(const uint16_t **samples) { return backend_->stream_get_block(samples); }
+
+void capture_stream_release_block(void) { backend_->stream_release_block(); }
+
+bool capture_stream_is_overrun(void) { return backend_->stream_is_overrun(); }
+
+uint get_pre_trigger_count(void) { return backend_->get_pre_trigger_count(); }
+
+int get_triggered_channel(void) { return backend_->get_triggered_channel ? backend_->get_triggered_channel() : -1; }
+
+int get_trigger_index(void) { return backend_->get_trigger_index ? backend_->get_trigger_index() : -1; }
+
+uint get_trigger_latency(void) { return backend_->get_trigger_latency ? backend_->get_trigger_latency() : 0; }
+
+uint get_segments_count(void) { return backend_->get_segments_count ? backend_->get_segments_count() : 0; }
+
+uint32_t get_segment_time(uint segment) {
+    return backend_->get_segment_time ? backend_->get_segment_time(segment) : 0;
+}
+
+uint get_capture_status(void) {
+    uint status = backend_->get_capture_status ? backend_->get_capture_status() : 0;
+    return capture_config_.is_mode_rejected ? status | CAPTURE_STATUS_MODE_REJECTED : status;
+}
+
+uint get_max_rate(uint channel_mask) { return backend_->get_max_rate ? backend_->get_max_rate(channel_mask) : 0; }
+
+uint capture_benchmark(uint max_rates[CAPTURE_WIDTHS_COUNT], uint rle_max_rates[CAPTURE_WIDTHS_COUNT]) {
+    return backend_->benchmark ? backend_->benchmark(max_rates, rle_max_rates) : 0;
+}
+
+uint capture_self_test(void) { return backend_->self_test ? backend_->self_test() : 0; }
+
+uint get_transitions_count(void) { return backend_->get_transitions_count ? backend_->get_transitions_count() : 0; }
+
+bool get_transition(uint index, capture_transition_t *transition) {
+    return backend_->get_transition ? backend_->get_transition(index, transition) : false;
+}
@@ -19,12 +19,38 @@
 #include "common.h"
 
 #include <stdarg.h>
+#include <string.h>
 
 #include "hardware/gpio.h"
+#include "hardware/sync.h"
 #include "hardware/uart.h"
 
+// Debug records per core. Power of two
+#define DEBUG_RING_SIZE 32
+
+// Max arguments of a debug message. The flags message (0x82) has 11
+#define DEBUG_ARGS_MAX 12
+
+// Deferred debug message: the format and its arguments, formatted when sent
+typedef struct debug_record_t {
+    const char *format;
+    uintptr_t args[DEBUG_ARGS_MAX];
+} debug_record_t;
+
+// Each core writes its own ring (single producer) and core0 sends them in idle time (single consumer)
+typedef struct debug_ring_t {
+    debug_record_t records[DEBUG_RING_SIZE];
+    volatile uint head, tail, dropped;
+} debug_ring_t;
+
 static char *buffer_;
 static bool *is_enabled_;
+static debug_ring_t ring_[2];
+static uint text_count_, text_index_, dropped_sent_;
+
+static inline bool debug_next_text(void);
+static inline uint format_record(const debug_record_t *record, char *text, uint size);
+static inline const char *next_conversion(const char *format, const char **start);
 
 void debug_init(uint baudrate, char *buffer, bool *is_enabled) {
     buffer_ = buffer;
@@ -32,7 +58,7 @@ void debug_init(uint baudrate, char *buffer, bool *is_enabled) {
     if (*is_enabled_) {
         uart_init(uart0, baudrate);
         uart_set_fifo_enabled(uart0, true);
-        gpio_set_function(16, GPIO_FUNC_UART);
+        gpio_set_function(GPIO_DEBUG_OUTPUT, GPIO_FUNC_UART);
     }
 }
 
@@ -40,29 +66,112 @@ void debug_reinit(void) {
     if (*is_enabled_) {
         uart_init(uart0, 115200);
         uart_set_fifo_enabled(uart0, true);
-        gpio_set_function(16, GPIO_FUNC_UART);
+        gpio_set_function(GPIO_DEBUG_OUTPUT, GPIO_FUNC_UART);
     }
 }
 
-void debug(const char *format, ...) {
-    if (*is_enabled_) {
+void debug_log(const char *format, ...) {
+    /*
+     * Store the format and its arguments only, so it can be called from interrupts, core1 and the capture and upload
+     * paths. The ring of the core is written with its interrupts disabled. Messages are dropped if the ring is full.
+     * String arguments must be constant
+     */
+
+    if (!*is_enabled_) return;
+
+    debug_ring_t *ring = &ring_[get_core_num()];
+    uint32_t interrupts = save_and_disable_interrupts();
+    if (ring->head - ring->tail >= DEBUG_RING_SIZE) {
+        ring->dropped++;
+    } else {
+        debug_record_t *record = &ring->records[ring->head & (DEBUG_RING_SIZE - 1)];
+        const char *start, *c = format;
+        uint count = 0;
         va_list args;
         va_start(args, format);
-        vsprintf(buffer_, format, args);
-        uart_puts(uart0, buffer_);
+        record->format = format;
+        while ((c = next_conversion(c, &start)) && count < DEBUG_ARGS_MAX) {
+            if (*c == 's' || *c == 'p')
+                record->args[count++] = (uintptr_t)va_arg(args, const void *);
+            else if (*c != '%')
+                record->args[count++] = va_arg(args, uint);
+            c++;
+        }
         va_end(args);
+        __dmb();
+        ring->head++;
     }
+    restore_interrupts(interrupts);
 }
 
-void debug_block(const char *format, ...) {
-    if (*is_enabled_) {
-        va_list args;
-        va_start(args, format);
-        vsprintf(buffer_, format, args);
-        uart_puts(uart0, buffer_);
-        va_end(args);
-        uart_tx_wait_blocking(uart0);
+void debug_task(void) {
+    // Idle time, core0: send the formatted messages while the UART FIFO has room, without waiting for it
+    if (!*is_enabled_) return;
+
+    while (uart_is_writable(uart0)) {
+        while (text_index_ == text_count_)
+            if (!debug_next_text()) return;
+        uart_putc_raw(uart0, buffer_[text_index_++]);
     }
 }
 
 bool debug_is_enabled(void) { return *is_enabled_; }
+
+static inline bool debug_next_text(void) {
+    // Format the next message to the debug buffer. Dropped messages are reported once the rings are sent
+    text_index_ = 0;
+    text_count_ = 0;
+    for (uint i = 0; i < 2; i++) {
+        debug_ring_t *ring = &ring_[i];
+        if (ring->tail == ring->head) continue;
+        __dmb();
+        text_count_ = format_record(&ring->records[ring->tail & (DEBUG_RING_SIZE - 1)], buffer_, DEBUG_BUFFER_SIZE);
+        __dmb();
+        ring->tail++;
+        return true;
+    }
+    uint dropped = ring_[0].dropped + ring_[1].dropped;
+    if (dropped == dropped_sent_) return false;
+    text_count_ = snprintf(buffer_, DEBUG_BUFFER_SIZE, "\nDebug: %u messages dropped", dropped - dropped_sent_);
+    dropped_sent_ = dropped;
+    return true;
+}
+
+static inline uint format_record(const debug_record_t *record, char *text, uint size) {
+    // Copy the text between conversions and format each conversion with its argument
+    char spec[16];
+    const char *start, *format = record->format;
+    uint length = 0, count = 0;
+    while (length < size - 1) {
+        const char *c = next_conversion(format, &start);
+        uint literal = (c ? start : format + strlen(format)) - format;
+        if (literal > size - 1 - length) literal = size - 1 - length;
+        memcpy(&text[length], format, literal);
+        length += literal;
+        if (!c || (uint)(c - start) + 1 >= sizeof(spec)) break;
+        memcpy(spec, start, c - start + 1);
+        spec[c - start + 1] = 0;
+        int written;
+        if (*c == '%')
+            written = snprintf(&text[length], size - length, "%%");
+        else if (count >= DEBUG_ARGS_MAX)
+            break;
+        else if (*c == 's' || *c == 'p')
+            written = snprintf(&text[length], size - length, spec, (const void *)record->args[count++]);
+        else
+            written = snprintf(&text[length], size - length, spec, (uint)record->args[count++]);
+        if (written > 0) length += (uint)written < size - length ? (uint)written : size - 1 - length;
+        format = c + 1;
+    }
+    text[length] = 0;
+    return length;
+}
+
+static inline const char *next_conversion(const char *format, const char **start) {
+    // Find the next conversion. Returns its conversion character and sets start to its '%'
+    const char *c = strchr(format, '%');
+    if (!c) return NULL;
+    *start = c++;
+    while (*c && strchr("-+ #0123456789.hlz", *c)) c++;
+    return *c ? c : NULL;
+}
@@ -27,16 +27,52 @@ extern "C" {
 
 #include "pico/types.h"
 
-// Number of channels
-#define CHANNEL_COUNT 16
+// Number of channels: GPIO 0-22 and 26-28. GPIO 16 and 17 read as low while they carry the debug output or the external
+// clock
+#define CHANNEL_COUNT 26
 
 // Maximum number of triggers
 #define TRIGGERS_COUNT 4
 
+// Sys clock. Fixed for capture and upload, capture rates are planned from it
+#define SYS_CLOCK_KHZ 200000
+
 // Debug buffer size
 #define DEBUG_BUFFER_SIZE 300
 
+// Debug levels. Messages above the build level are compiled out. Build with -DDEBUG_LEVEL=2 for the per sample
+// messages
+#define DEBUG_LEVEL_NONE 0
+#define DEBUG_LEVEL_INFO 1
+#define DEBUG_LEVEL_VERBOSE 2
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL DEBUG_LEVEL_INFO
+#endif
+
+// Debug messages are stored and sent later by debug_task(), so none of them waits for the UART. debug_block() is
+// kept as a name for the messages of the capture and command paths
+#if DEBUG_LEVEL >= DEBUG_LEVEL_INFO
+#define debug(...) debug_log(__VA_ARGS__)
+#define debug_block(...) debug_log(__VA_ARGS__)
+#else
+#define debug(...)                     \
+    do {                               \
+        if (0) debug_log(__VA_ARGS__); \
+    } while (0)
+#define debug_block(...) debug(__VA_ARGS__)
+#endif
+#if DEBUG_LEVEL >= DEBUG_LEVEL_VERBOSE
+#define debug_verbose(...) debug_log(__VA_ARGS__)
+#else
+#define debug_verbose(...)             \
+    do {                               \
+        if (0) debug_log(__VA_ARGS__); \
+    } while (0)
+#endif
+
 typedef enum gpio_config_t {
+    GPIO_DEBUG_OUTPUT = 16,
+    GPIO_CLOCK_EXTERNAL = 17,  // External clock input for synchronous captures
     GPIO_DEBUG_ENABLE = 18,
     GPIO_TRIGGER_STAGES = 19  // If gpio 20 grounded: triggers are based on stages. If gpio 20 not grounded: all
                               // triggers at stage 0 are edge triggers
@@ -44,19 +80,49 @@ typedef enum gpio_config_t {
 
 typedef enum command_t { COMMAND_NONE, COMMAND_RESET, COMMAND_CAPTURE } command_t;
 
+typedef enum capture_mode_t {
+    CAPTURE_MODE_ONE_SHOT,
+    CAPTURE_MODE_STREAM,    // Samples are sent while capturing, oldest first. No pre trigger samples
+    CAPTURE_MODE_RLE,       // Post trigger samples are run length encoded by core1 while capturing
+    CAPTURE_MODE_SEGMENTED,  // One segment per trigger, rearmed after each segment
+    CAPTURE_MODE_TRANSITION  // The channels value and its time are stored when the channels change
+} capture_mode_t;
+
 typedef enum trigger_match_t {
-    TRIGGER_TYPE_LEVEL_LOW,
-    TRIGGER_TYPE_LEVEL_HIGH,
-    TRIGGER_TYPE_EDGE_LOW,
-    TRIGGER_TYPE_EDGE_HIGH
+    TRIGGER_MATCH_LEVEL,  // Channels in mask equal to value
+    TRIGGER_MATCH_EDGE,   // Channels in mask change to value
+    TRIGGER_MATCH_UART,   // Byte received equal to value. 8 data bits, no parity, 1 stop bit
+    TRIGGER_MATCH_SPI,    // Byte equal to value, most significant bit first. Aligned to the chip select if connected
+    TRIGGER_MATCH_I2C     // 7 bit address after a start equal to value
 } trigger_match_t;
 
+// Channels of the protocol triggers. UART: RX. SPI: clock, data and chip select. I2C: SCL and SDA
+#define TRIGGER_CHANNELS_COUNT 3
+#define TRIGGER_CHANNEL_NONE 31
+
 typedef struct trigger_t {
     bool is_enabled;
-    uint pin;
+    uint mask;
+    uint value;
     trigger_match_t match;
+    uint channel[TRIGGER_CHANNELS_COUNT];  // protocol triggers
+    uint baud_rate;                        // UART trigger
+    uint spi_mode;                         // SPI trigger. Clock polarity in bit 1 and clock phase in bit 0
 } trigger_t;
 
+// Performance counters: last capture and upload, and totals since boot. All fields are uint, sent in this order
+typedef struct counters_t {
+    uint arm_time;             // us from capture start to state machines enabled
+    uint trigger_time;         // us from the trigger (or the start without triggers) to capture complete
+    uint samples;              // samples captured
+    uint pre_trigger_missing;  // requested pre trigger samples not captured
+    uint upload_bytes;
+    uint upload_time;  // us
+    uint stalls;       // total capture FIFO stalls
+    uint captures;     // total captures
+    uint commands;     // total commands received
+} counters_t;
+
 typedef struct config_t {
     uint channels;
     bool trigger_edge;
@@ -68,13 +134,19 @@ typedef struct capture_config_t {
     uint rate;
     uint pre_trigger_samples;
     uint channels;
-    trigger_t trigger[4];
+    uint channel_mask;  // Enabled channels. Samples are packed to the enabled channels width
+    capture_mode_t mode;
+    bool clock_external;  // One sample per rising edge of the external clock, or falling edge if inverted
+    bool clock_invert;
+    uint segments;          // Segmented mode: number of segments the samples and the sample memory are split into
+    bool is_mode_rejected;  // Stream or RLE rate too high, run as one shot. Added to the capture status
+    trigger_t trigger[TRIGGERS_COUNT];
 } capture_config_t;
 
 void debug_init(uint baudrate, char *buffer, bool *is_enabled);
 void debug_reinit(void);
-void debug(const char *format, ...);
-void debug_block(const char *format, ...);
+void debug_log(const char *format, ...);
+void debug_task(void);
 bool debug_is_enabled(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,242 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "decoder.h"
+
+#include "capture.h"
+
+// UART bit times in samples are fixed point with these fraction bits
+#define UART_FRACTION_BITS 16
+
+static decoder_protocol_t protocol_ = DECODER_PROTOCOL_NONE;
+static uint channel_[DECODER_CHANNELS_MAX], spi_mode_, baud_rate_ = 115200;
+static decoder_output_t output_;
+static uint records_count_;
+
+// Decoding state. Value of the decoder channels, byte being decoded and its first sample
+static uint value_, bits_, bits_miso_, bits_count_, byte_sample_, bit_sample_, byte_flags_, spi_edge_;
+static bool is_frame_, is_transfer_, is_bit_;
+static uint64_t bit_time_, bit_period_;
+
+static inline void decode_span(const capture_span_t *span, uint sample, uint mask);
+static inline void decode_value(uint sample, uint value);
+static inline void uart_change(uint sample, uint value);
+static inline void uart_bit(uint level);
+static inline void spi_change(uint sample, uint value);
+static inline void spi_send(uint flags);
+static inline void i2c_change(uint sample, uint value);
+static inline void send_record(uint sample, uint data, uint flags);
+
+void decoder_set_config(uint config) {
+    protocol_ = config & 0xf;
+    if (protocol_ > DECODER_PROTOCOL_I2C) protocol_ = DECODER_PROTOCOL_NONE;
+    spi_mode_ = (config >> 4) & 3;
+    for (uint i = 0; i < DECODER_CHANNELS_MAX; i++) {
+        channel_[i] = (config >> (8 + 5 * i)) & 0x1f;
+        if (channel_[i] >= CHANNEL_COUNT) channel_[i] = DECODER_CHANNEL_NONE;
+    }
+}
+
+void decoder_set_baud_rate(uint baud_rate) { baud_rate_ = baud_rate ? baud_rate : 1; }
+
+decoder_protocol_t decoder_get_protocol(void) { return protocol_; }
+
+uint decoder_get_channel(uint index) { return index < DECODER_CHANNELS_MAX ? channel_[index] : DECODER_CHANNEL_NONE; }
+
+uint decoder_get_baud_rate(void) { return baud_rate_; }
+
+uint decoder_get_spi_mode(void) { return spi_mode_; }
+
+uint decoder_run(decoder_output_t output) {
+    /*
+     * Oldest sample first. The decoders are fed the changes of their channels: transition captures as stored, spans
+     * a word at a time skipping the words equal to the last value, otherwise (RLE captures) one sample at a time
+     */
+
+    uint mask = 0;
+    for (uint i = 0; i < DECODER_CHANNELS_MAX; i++)
+        if (channel_[i] != DECODER_CHANNEL_NONE) mask |= 1u << channel_[i];
+    output_ = output;
+    records_count_ = 0;
+    value_ = get_sample_index(0) & mask;
+    bits_ = 0;
+    bits_miso_ = 0;
+    bits_count_ = 0;
+    byte_flags_ = 0;
+    is_frame_ = false;
+    is_transfer_ = false;
+    is_bit_ = false;
+    // SPI samples on the rising edge when the clock polarity and phase are equal (modes 0 and 3)
+    spi_edge_ = ((spi_mode_ >> 1) ^ spi_mode_ ^ 1) & 1;
+    bit_period_ = ((uint64_t)get_capture_rate() << UART_FRACTION_BITS) / baud_rate_;
+    if (!protocol_ || !mask) return 0;
+
+    capture_span_t spans[CAPTURE_SPANS_MAX];
+    uint spans_count = get_capture_spans(spans);
+    uint transitions_count = get_transitions_count();
+    uint samples = get_samples_count();
+    if (transitions_count) {
+        capture_transition_t transition;
+        for (uint i = 1; i < transitions_count && get_transition(i, &transition); i++)
+            decode_value(transition.sample, transition.value & mask);
+    } else if (spans_count) {
+        for (uint i = 0, sample = 0; i < spans_count; sample += spans[i].count, i++)
+            decode_span(&spans[i], sample, mask);
+    } else {
+        for (uint i = 1; i < samples; i++) decode_value(i, get_sample_index(i) & mask);
+    }
+    // Bits of a UART frame up to the last sample
+    if (protocol_ == DECODER_PROTOCOL_UART) uart_change(samples, value_);
+    return records_count_;
+}
+
+static inline void decode_span(const capture_span_t *span, uint sample, uint mask) {
+    // Words with all the samples equal to the last value are skipped at once
+    uint bits = 5 - __builtin_ctz(span->width), samples_per_word = 1u << bits;
+    uint sample_mask = 0xffffffffu >> (32 - span->width), replicate = 0xffffffffu / sample_mask;
+    uint span_mask = (mask >> span->base) & sample_mask;
+    uint32_t word_mask = span_mask * replicate;
+    uint index = span->first, end = span->first + span->count;
+    while (index < end) {
+        if (!(index & (samples_per_word - 1)) && end - index >= samples_per_word &&
+            (span->buffer[index >> bits] & word_mask) == (value_ >> span->base) * replicate) {
+            index += samples_per_word;
+            continue;
+        }
+        uint value = ((span->buffer[index >> bits] >> ((index & (samples_per_word - 1)) * span->width)) & span_mask)
+                     << span->base;
+        decode_value(sample + index - span->first, value);
+        index++;
+    }
+}
+
+static inline void decode_value(uint sample, uint value) {
+    if (value == value_) return;
+    switch (protocol_) {
+        case DECODER_PROTOCOL_UART:
+            uart_change(sample, value);
+            break;
+        case DECODER_PROTOCOL_SPI:
+            spi_change(sample, value);
+            break;
+        case DECODER_PROTOCOL_I2C:
+            i2c_change(sample, value);
+            break;
+        default:
+            break;
+    }
+    value_ = value;
+}
+
+static inline void uart_change(uint sample, uint value) {
+    // The bits up to the change have the level before it, read at the middle of each bit. A falling edge out of a
+    // frame is a start bit
+    uint level = (value_ >> channel_[0]) & 1;
+    uint64_t time = (uint64_t)sample << UART_FRACTION_BITS;
+    while (is_frame_ && bit_time_ < time) uart_bit(level);
+    if (!is_frame_ && level && !((value >> channel_[0]) & 1)) {
+        is_frame_ = true;
+        bits_ = 0;
+        bits_count_ = 0;
+        byte_sample_ = sample;
+        bit_time_ = time + bit_period_ / 2;
+    }
+}
+
+static inline void uart_bit(uint level) {
+    // Start bit, 8 data bits and stop bit. A start bit high at its middle was a glitch
+    if (!bits_count_) {
+        if (level) is_frame_ = false;
+    } else if (bits_count_ <= 8) {
+        bits_ |= level << (bits_count_ - 1);
+    } else {
+        send_record(byte_sample_, bits_, level ? 0 : DECODER_FLAG_ERROR);
+        is_frame_ = false;
+    }
+    bits_count_++;
+    bit_time_ += bit_period_;
+}
+
+static inline void spi_change(uint sample, uint value) {
+    // Chip select changes end the byte. The data channels are read at the sampling clock edges while selected
+    if (((value ^ value_) >> channel_[3]) & 1) {
+        if (bits_count_) spi_send(DECODER_FLAG_ERROR);
+        byte_flags_ = DECODER_FLAG_START;
+        return;
+    }
+    uint clock = (value >> channel_[0]) & 1;
+    if ((value >> channel_[3]) & 1 || clock == ((value_ >> channel_[0]) & 1) || clock != spi_edge_) return;
+    if (!bits_count_) byte_sample_ = sample;
+    bits_ = (bits_ << 1) | ((value >> channel_[1]) & 1);
+    bits_miso_ = (bits_miso_ << 1) | ((value >> channel_[2]) & 1);
+    if (++bits_count_ == 8) spi_send(0);
+}
+
+static inline void spi_send(uint flags) {
+    send_record(byte_sample_, bits_, byte_flags_ | flags);
+    if (channel_[2] != DECODER_CHANNEL_NONE)
+        send_record(byte_sample_, bits_miso_, byte_flags_ | flags | DECODER_FLAG_MISO);
+    bits_ = 0;
+    bits_miso_ = 0;
+    bits_count_ = 0;
+    byte_flags_ = 0;
+}
+
+static inline void i2c_change(uint sample, uint value) {
+    /*
+     * SDA falling while SCL is high is a start, rising a stop. Each bit is the SDA level while SCL was high, read at
+     * the SCL falling edge, so the clock before a stop is not a bit: 8 data bits, most significant first, and the
+     * acknowledge bit
+     */
+
+    uint scl = (value >> channel_[0]) & 1, scl_prev = (value_ >> channel_[0]) & 1;
+    uint sda_prev = (value_ >> channel_[1]) & 1;
+    if (scl && scl_prev) {
+        if (((value >> channel_[1]) & 1) == sda_prev) return;
+        if (bits_count_) send_record(byte_sample_, bits_, byte_flags_ | DECODER_FLAG_ERROR);
+        is_transfer_ = sda_prev;
+        is_bit_ = false;
+        bits_ = 0;
+        bits_count_ = 0;
+        byte_flags_ = DECODER_FLAG_START | DECODER_FLAG_ADDRESS;
+        return;
+    }
+    if (!is_transfer_ || scl == scl_prev) return;
+    if (scl) {
+        is_bit_ = true;
+        bit_sample_ = sample;
+        return;
+    }
+    if (!is_bit_) return;
+    is_bit_ = false;
+    if (!bits_count_) byte_sample_ = bit_sample_;
+    if (bits_count_++ < 8) {
+        bits_ = (bits_ << 1) | sda_prev;
+        return;
+    }
+    send_record(byte_sample_, bits_, byte_flags_ | (sda_prev ? DECODER_FLAG_NACK : 0));
+    bits_ = 0;
+    bits_count_ = 0;
+    byte_flags_ = 0;
+}
+
+static inline void send_record(uint sample, uint data, uint flags) {
+    decoder_record_t record = {.sample = sample, .data = data, .flags = flags};
+    output_(&record);
+    records_count_++;
+}
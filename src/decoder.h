@@ -0,0 +1,80 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+/*
+ * Protocol decoders run by core1 over the last capture. The decoded bytes are sent as records instead of the samples
+ *
+ * Configuration (32 bits):
+ * - Bits 0-3: protocol
+ * - Bits 4-5: SPI mode. Clock polarity in bit 5 and clock phase in bit 4
+ * - Bits 8-12, 13-17, 18-22 and 23-27: decoder channels. UART: RX. SPI: clock, MOSI, MISO and chip select. I2C: SCL and
+ *   SDA. DECODER_CHANNEL_NONE for a channel not connected: SPI without MISO or with the chip select always asserted
+ *
+ * Record: first sample of the byte (4 bytes), byte (1 byte) and flags (1 byte). Little endian. The sample is the index
+ * from the first captured sample. The last record is the end record: records count (4 bytes), 0 and DECODER_FLAG_END
+ */
+
+#define DECODER_CHANNELS_MAX 4
+#define DECODER_CHANNEL_NONE 31
+#define DECODER_RECORD_SIZE 6
+
+// Record flags
+#define DECODER_FLAG_START (1 << 0)    // first byte after an I2C start or the SPI chip select asserted
+#define DECODER_FLAG_ADDRESS (1 << 1)  // I2C address and read/write bit
+#define DECODER_FLAG_NACK (1 << 2)     // I2C byte not acknowledged
+#define DECODER_FLAG_MISO (1 << 3)     // SPI byte of the MISO channel. MOSI otherwise
+#define DECODER_FLAG_ERROR (1 << 4)    // UART stop bit low, or I2C and SPI transfer ended inside the byte
+#define DECODER_FLAG_END 0xff          // end record
+
+typedef enum decoder_protocol_t {
+    DECODER_PROTOCOL_NONE,
+    DECODER_PROTOCOL_UART,  // 8 data bits, no parity, 1 stop bit, least significant bit first
+    DECODER_PROTOCOL_SPI,   // 8 bits, most significant bit first
+    DECODER_PROTOCOL_I2C
+} decoder_protocol_t;
+
+typedef struct decoder_record_t {
+    uint32_t sample;
+    uint8_t data;
+    uint8_t flags;
+} decoder_record_t;
+
+typedef void (*decoder_output_t)(const decoder_record_t *record);
+
+void decoder_set_config(uint config);
+void decoder_set_baud_rate(uint baud_rate);
+decoder_protocol_t decoder_get_protocol(void);
+uint decoder_get_channel(uint index);
+uint decoder_get_baud_rate(void);
+uint decoder_get_spi_mode(void);
+uint decoder_run(decoder_output_t output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
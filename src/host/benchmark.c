@@ -0,0 +1,463 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host benchmark of the SUMP command parser and sample encoders
+ *
+ * Synthetic traces are loaded into the host capture and uploaded with sump_send_samples() through the mock USB
+ * sink. Reports ns/sample, output bytes and RLE ratio (raw bytes / output bytes) for each trace and encoder.
+ * "loop" encoders read the capture one sample at a time with get_sample_index() instead of the capture spans, and
+ * their output is checked against the span encoder of the previous row. "transition" encoders upload a transition
+ * capture of the trace, and are checked against the previous row as well. "frame" encoders use the framed upload, and
+ * their output is decoded with the reference decoder and checked against the trace. "decode" rows run the protocol
+ * decoder over a bus trace and check the decoded bytes. The RLE ratio is the raw 16 channels bytes / output bytes.
+ * Each vendor long command is followed by a send ID, which must be replied if the 4 value bytes were read.
+ *
+ * The encoders run on the core1 thread of the mock, so on a single core host the times include the thread switches.
+ *
+ * Usage: benchmark [samples] [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture_host.h"
+#include "common.h"
+#include "decoder.h"
+#include "frame_decoder.h"
+#include "mock.h"
+#include "protocol_sump.h"
+
+#define DEFAULT_SAMPLES 20000
+#define DEFAULT_ITERATIONS 10
+
+// Sump flags used by the benchmark (see sump_flag_bits_t)
+#define FLAG_DISABLE_CHANGROUP_2 (1 << 3)
+#define FLAG_DISABLE_CHANGROUP_3 (1 << 4)
+#define FLAG_DISABLE_CHANGROUP_4 (1 << 5)
+#define FLAG_RLE (1 << 8)
+#define FLAGS_24CH FLAG_DISABLE_CHANGROUP_4
+#define FLAGS_16CH (FLAG_DISABLE_CHANGROUP_3 | FLAG_DISABLE_CHANGROUP_4)
+#define FLAGS_8CH (FLAG_DISABLE_CHANGROUP_2 | FLAGS_16CH)
+
+// Bus traces: 10 samples per UART bit, 8 samples per SPI and I2C clock period
+#define BUS_BAUD_RATE 10000000
+#define BUS_BIT_SAMPLES 10
+#define BUS_CLOCK_SAMPLES 8
+#define DECODER_CHANNELS(A, B, C, D) ((A) << 8 | (B) << 13 | (C) << 18 | (D) << 23)
+
+typedef enum trace_type_t { TRACE_IDLE, TRACE_CLOCK, TRACE_BURSTY, TRACE_RANDOM, TRACE_COUNT } trace_type_t;
+
+typedef struct bus_t {
+    const char *name;
+    decoder_protocol_t protocol;
+    uint config;
+} bus_t;
+
+typedef struct encoder_t {
+    const char *name;
+    uint flags;
+    uint bytes_per_sample;
+    capture_mode_t mode;
+    bool is_loop;
+    bool is_framed;
+} encoder_t;
+
+config_t config_;
+capture_config_t capture_config_;
+counters_t counters_;
+
+static char debug_message_[DEBUG_BUFFER_SIZE];
+static const char *trace_name_[TRACE_COUNT] = {"idle", "clock", "bursty", "random"};
+static const encoder_t encoder_[] = {
+    {"raw 24ch", FLAGS_24CH, 3, CAPTURE_MODE_ONE_SHOT, false, false},
+    {"raw 24ch loop", FLAGS_24CH, 3, CAPTURE_MODE_ONE_SHOT, true, false},
+    {"raw 16ch", FLAGS_16CH, 2, CAPTURE_MODE_ONE_SHOT, false, false},
+    {"raw 16ch loop", FLAGS_16CH, 2, CAPTURE_MODE_ONE_SHOT, true, false},
+    {"raw 16ch trans", FLAGS_16CH, 2, CAPTURE_MODE_TRANSITION, false, false},
+    {"raw 8ch", FLAGS_8CH, 1, CAPTURE_MODE_ONE_SHOT, false, false},
+    {"raw 8ch loop", FLAGS_8CH, 1, CAPTURE_MODE_ONE_SHOT, true, false},
+    {"rle 24ch", FLAG_RLE | FLAGS_24CH, 3, CAPTURE_MODE_ONE_SHOT, false, false},
+    {"rle 24ch loop", FLAG_RLE | FLAGS_24CH, 3, CAPTURE_MODE_ONE_SHOT, true, false},
+    {"rle 16ch", FLAG_RLE | FLAGS_16CH, 2, CAPTURE_MODE_ONE_SHOT, false, false},
+    {"rle 16ch loop", FLAG_RLE | FLAGS_16CH, 2, CAPTURE_MODE_ONE_SHOT, true, false},
+    {"rle 16ch trans", FLAG_RLE | FLAGS_16CH, 2, CAPTURE_MODE_TRANSITION, false, false},
+    {"rle 8ch", FLAG_RLE | FLAGS_8CH, 1, CAPTURE_MODE_ONE_SHOT, false, false},
+    {"rle 8ch loop", FLAG_RLE | FLAGS_8CH, 1, CAPTURE_MODE_ONE_SHOT, true, false},
+    {"frame 16ch", FLAGS_16CH, 2, CAPTURE_MODE_ONE_SHOT, false, true},
+    {"frame 16ch loop", FLAGS_16CH, 2, CAPTURE_MODE_ONE_SHOT, true, true},
+    {"frame 8ch", FLAGS_8CH, 1, CAPTURE_MODE_ONE_SHOT, false, true},
+    {"frame 16ch trans", FLAGS_16CH, 2, CAPTURE_MODE_TRANSITION, false, true},
+    {"stream", FLAGS_16CH, 2, CAPTURE_MODE_STREAM, false, false}};
+static const bus_t bus_[] = {
+    {"uart", DECODER_PROTOCOL_UART,
+     DECODER_PROTOCOL_UART | DECODER_CHANNELS(0, DECODER_CHANNEL_NONE, DECODER_CHANNEL_NONE, DECODER_CHANNEL_NONE)},
+    {"spi", DECODER_PROTOCOL_SPI, DECODER_PROTOCOL_SPI | DECODER_CHANNELS(0, 1, 2, 3)},
+    {"i2c", DECODER_PROTOCOL_I2C,
+     DECODER_PROTOCOL_I2C | DECODER_CHANNELS(0, 1, DECODER_CHANNEL_NONE, DECODER_CHANNEL_NONE)}};
+static uint32_t seed_, output_hash_;
+static uint8_t output_tail_[4];  // last bytes sent
+static uint commands_pending_;  // commands sent and not read yet
+static uint8_t *output_;
+static uint output_length_, output_max_;
+
+static uint32_t random_next(void);
+static void trace_generate(trace_type_t type, uint16_t *samples, uint count);
+static uint bus_generate(decoder_protocol_t protocol, uint16_t *samples, uint count, uint8_t *bytes);
+static void bus_put(uint16_t *samples, uint *index, uint value, uint count);
+static void command_send(uint8_t command);
+static void command_send_uint32(uint8_t command, uint32_t value);
+static void configure(uint samples, uint flags, capture_mode_t mode);
+static double elapsed_ns(const struct timespec *start);
+static void complete_handler(void);
+static void output_hash(const uint8_t *data, uint length);
+static void output_keep_tail(const uint8_t *data, uint length);
+static bool frame_check(const uint16_t *trace, uint count, uint mask);
+static bool decode_check(const uint8_t *bytes, uint bytes_count);
+
+int main(int argc, char **argv) {
+    uint samples = argc > 1 ? (uint)atoi(argv[1]) : DEFAULT_SAMPLES;
+    uint iterations = argc > 2 ? (uint)atoi(argv[2]) : DEFAULT_ITERATIONS;
+    samples &= ~3u;  // sample and pre trigger sizes are sent in units of 4 samples
+    if (samples < 4 || iterations < 1) {
+        fprintf(stderr, "Usage: %s [samples] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    uint16_t *trace = malloc(samples * sizeof(uint16_t));
+    uint8_t *bytes = malloc(samples);
+    int result = 0;
+    if (!trace || !bytes) return 1;
+
+    config_.channels = capture_config_.channels = CHANNEL_COUNT;
+    config_.trigger_edge = true;
+    debug_init(115200, &debug_message_[0], &config_.debug);
+    capture_set_backend(&capture_backend_replay);
+    capture_init(0, capture_config_.channels, complete_handler);
+    sump_init();
+
+    // Command parser
+    struct timespec start;
+    uint commands = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint i = 0; i < iterations * 100; i++) {
+        configure(samples, FLAG_RLE, CAPTURE_MODE_ONE_SHOT);
+        command_send_uint32(0xC0, 0x0003);    // trigger stage 0 mask
+        command_send_uint32(0xC1, 0x0001);    // trigger stage 0 values
+        command_send_uint32(0xC2, 1u << 27);  // trigger stage 0 configuration: start
+        command_send(0x01);                   // run
+        while (commands_pending_) {
+            sump_read();
+            commands_pending_--;
+            commands++;
+        }
+        sump_reset();
+    }
+    printf("Parser: %u commands, %.1f ns/command\n", commands, elapsed_ns(&start) / commands);
+
+    // Vendor long commands: the 4 value bytes must be read, so the next send ID is parsed as a command
+    mock_output_set_handler(output_keep_tail);
+    for (uint c = 0xA0; c <= 0xAF; c++) {
+        memset(output_tail_, 0, sizeof(output_tail_));
+        command_send_uint32(c, c == 0xA1 ? (1u << CHANNEL_COUNT) - 1 : 0);  // all channels in use
+        command_send(0x02);                                                // send id
+        for (; commands_pending_; commands_pending_--) sump_read();
+        if (memcmp(output_tail_, "1ALS", 4)) {
+            fprintf(stderr, "Parser out of sync: 0x%X\n", c);
+            result = 1;
+        }
+    }
+    mock_output_set_handler(NULL);
+    sump_reset();
+    printf("Parser sync: %s\n\n", result ? "failed" : "ok");
+
+    // Encoders
+    printf("%-8s %-16s %12s %14s %10s %10s\n", "trace", "encoder", "ns/sample", "output bytes", "RLE ratio",
+           "MB/s");
+    for (trace_type_t type = 0; type < TRACE_COUNT; type++) {
+        trace_generate(type, trace, samples);
+        capture_host_set_trace(trace, samples);
+        uint32_t hash = 0;
+        for (uint i = 0; i < sizeof(encoder_) / sizeof(encoder_t); i++) {
+            capture_host_set_spans_enabled(!encoder_[i].is_loop);
+            configure(samples, encoder_[i].flags, encoder_[i].mode);
+            command_send(encoder_[i].is_framed ? FRAME_HANDSHAKE : 0x00);
+            command_send(0x01);
+            for (; commands_pending_; commands_pending_--) {
+                if (sump_read() == COMMAND_CAPTURE)
+                    capture_start(capture_config_.total_samples, capture_config_.rate,
+                                  capture_config_.pre_trigger_samples);
+            }
+            // Hash and keep the output of the first upload
+            output_hash_ = 2166136261u;
+            output_length_ = 0;
+            mock_output_set_handler(output_hash);
+            if (encoder_[i].mode == CAPTURE_MODE_STREAM) {
+                capture_start(capture_config_.total_samples, capture_config_.rate, 0);
+                sump_send_stream();
+            } else {
+                sump_send_samples();
+            }
+            mock_output_set_handler(NULL);
+            bool is_checked =
+                encoder_[i].is_loop || (encoder_[i].mode == CAPTURE_MODE_TRANSITION && !encoder_[i].is_framed);
+            if (is_checked && output_hash_ != hash) {
+                fprintf(stderr, "Output mismatch: %s %s\n", trace_name_[type], encoder_[i].name);
+                result = 1;
+            }
+            uint mask = encoder_[i].bytes_per_sample == 1 ? 0xff : 0xffff;
+            if (encoder_[i].is_framed && !frame_check(trace, samples, mask)) {
+                fprintf(stderr, "Frame decode mismatch: %s %s\n", trace_name_[type], encoder_[i].name);
+                result = 1;
+            }
+            hash = output_hash_;
+
+            mock_output_reset();
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (uint j = 0; j < iterations; j++) {
+                if (encoder_[i].mode == CAPTURE_MODE_STREAM) {
+                    capture_start(capture_config_.total_samples, capture_config_.rate, 0);
+                    sump_send_stream();
+                } else {
+                    sump_send_samples();
+                }
+            }
+            double ns = elapsed_ns(&start);
+            uint64_t bytes = mock_output_count() / iterations;
+            double ratio = (double)samples * encoder_[i].bytes_per_sample / bytes;
+            printf("%-8s %-16s %12.2f %14llu %10.2f %10.1f\n", trace_name_[type], encoder_[i].name,
+                   ns / ((double)samples * iterations), (unsigned long long)bytes, ratio,
+                   (double)bytes * iterations / ns * 1000);
+        }
+    }
+
+    // Decoders
+    for (uint i = 0; i < sizeof(bus_) / sizeof(bus_t); i++) {
+        uint bytes_count = bus_generate(bus_[i].protocol, trace, samples, bytes);
+        capture_host_set_trace(trace, samples);
+        capture_host_set_spans_enabled(true);
+        configure(samples, FLAGS_16CH, CAPTURE_MODE_ONE_SHOT);
+        command_send(0x00);
+        command_send_uint32(0xA8, bus_[i].config);
+        command_send_uint32(0xA9, BUS_BAUD_RATE);
+        command_send(0x01);
+        for (; commands_pending_; commands_pending_--) {
+            if (sump_read() == COMMAND_CAPTURE)
+                capture_start(capture_config_.total_samples, capture_config_.rate,
+                              capture_config_.pre_trigger_samples);
+        }
+        output_length_ = 0;
+        mock_output_set_handler(output_hash);
+        command_send_uint32(0xAA, 0);
+        for (; commands_pending_; commands_pending_--) sump_read();
+        mock_output_set_handler(NULL);
+        if (!decode_check(bytes, bytes_count)) {
+            fprintf(stderr, "Decode mismatch: %s\n", bus_[i].name);
+            result = 1;
+        }
+
+        mock_output_reset();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint j = 0; j < iterations; j++) {
+            command_send_uint32(0xAA, 0);
+            for (; commands_pending_; commands_pending_--) sump_read();
+        }
+        double ns = elapsed_ns(&start);
+        uint64_t output_bytes = mock_output_count() / iterations;
+        printf("%-8s %-16s %12.2f %14llu %10.2f %10.1f\n", bus_[i].name, "decode",
+               ns / ((double)samples * iterations), (unsigned long long)output_bytes,
+               (double)samples * 2 / output_bytes, (double)output_bytes * iterations / ns * 1000);
+    }
+
+    free(trace);
+    free(bytes);
+    free(output_);
+    return result;
+}
+
+static uint32_t random_next(void) {
+    // xorshift32
+    seed_ ^= seed_ << 13;
+    seed_ ^= seed_ >> 17;
+    seed_ ^= seed_ << 5;
+    return seed_;
+}
+
+static void trace_generate(trace_type_t type, uint16_t *samples, uint count) {
+    seed_ = 0x12345678;
+    uint16_t data = 0;
+    for (uint i = 0; i < count; i++) {
+        switch (type) {
+            case TRACE_IDLE:
+                samples[i] = 0x0001;
+                break;
+            case TRACE_CLOCK:
+                // Channel 0: clock, 8 samples per period. Channels 1-7: data changing on falling edge
+                if ((i & 7) == 4) data = random_next() & 0xfe;
+                samples[i] = data | ((i >> 2) & 1);
+                break;
+            case TRACE_BURSTY:
+                // Bursts of 500 random samples every 10000 samples
+                samples[i] = (i % 10000) < 500 ? (uint16_t)random_next() : 0x0001;
+                break;
+            default:
+                samples[i] = random_next();
+                break;
+        }
+    }
+}
+
+static uint bus_generate(decoder_protocol_t protocol, uint16_t *samples, uint count, uint8_t *bytes) {
+    /*
+     * Random bytes on a bus, as many as fit. UART: RX on channel 0, idle between bytes. SPI mode 0: clock, MOSI, MISO
+     * and chip select on channels 0 to 3, 4 bytes per transfer and MISO the inverted MOSI byte. I2C: SCL and SDA on
+     * channels 0 and 1, an address and 3 data bytes per transfer, all acknowledged. Returns the bytes count
+     */
+
+    uint half = BUS_CLOCK_SAMPLES / 2, index = 0, bytes_count = 0;
+    uint unit = protocol == DECODER_PROTOCOL_UART ? 12 * BUS_BIT_SAMPLES : 48 * BUS_CLOCK_SAMPLES;
+    seed_ = 0x12345678;
+    while (index + unit < count) {
+        if (protocol == DECODER_PROTOCOL_UART) {
+            uint byte = random_next() & 0xff;
+            bytes[bytes_count++] = byte;
+            bus_put(samples, &index, 1, 2 * BUS_BIT_SAMPLES);
+            bus_put(samples, &index, 0, BUS_BIT_SAMPLES);
+            for (uint bit = 0; bit < 8; bit++) bus_put(samples, &index, (byte >> bit) & 1, BUS_BIT_SAMPLES);
+            bus_put(samples, &index, 1, BUS_BIT_SAMPLES);
+        } else if (protocol == DECODER_PROTOCOL_SPI) {
+            bus_put(samples, &index, 0x8, 2 * BUS_CLOCK_SAMPLES);
+            for (uint i = 0; i < 4; i++) {
+                uint byte = random_next() & 0xff;
+                bytes[bytes_count++] = byte;
+                for (uint bit = 8; bit-- > 0;) {
+                    uint data = ((byte >> bit) & 1) << 1 | (((~byte) >> bit) & 1) << 2;
+                    bus_put(samples, &index, data, half);
+                    bus_put(samples, &index, data | 1, half);
+                }
+            }
+            bus_put(samples, &index, 0, half);
+            bus_put(samples, &index, 0x8, half);
+        } else {
+            bus_put(samples, &index, 3, 2 * BUS_CLOCK_SAMPLES);
+            bus_put(samples, &index, 1, half);
+            for (uint i = 0; i < 4; i++) {
+                uint byte = random_next() & 0xff;
+                bytes[bytes_count++] = byte;
+                // 8 data bits and the acknowledge (SDA low)
+                for (uint bit = 9; bit-- > 1;) {
+                    uint sda = ((byte >> (bit - 1)) & 1) << 1;
+                    bus_put(samples, &index, sda, half);
+                    bus_put(samples, &index, sda | 1, half);
+                }
+                bus_put(samples, &index, 0, half);
+                bus_put(samples, &index, 1, half);
+            }
+            bus_put(samples, &index, 0, half);
+            bus_put(samples, &index, 1, half);
+            bus_put(samples, &index, 3, half);
+        }
+    }
+    bus_put(samples, &index, protocol == DECODER_PROTOCOL_SPI ? 0x8 : protocol == DECODER_PROTOCOL_I2C ? 3 : 1,
+            count - index);
+    return bytes_count;
+}
+
+static void bus_put(uint16_t *samples, uint *index, uint value, uint count) {
+    for (uint i = 0; i < count; i++) samples[(*index)++] = value;
+}
+
+static void command_send(uint8_t command) {
+    mock_input_push(&command, 1);
+    commands_pending_++;
+}
+
+static void command_send_uint32(uint8_t command, uint32_t value) {
+    uint8_t buffer[5] = {command, value, value >> 8, value >> 16, value >> 24};
+    mock_input_push(buffer, sizeof(buffer));
+    commands_pending_++;
+}
+
+static void configure(uint samples, uint flags, capture_mode_t mode) {
+    command_send_uint32(0xA0, mode);                                   // capture mode
+    command_send_uint32(0x80, mode == CAPTURE_MODE_STREAM ? 999 : 0);  // divisor: 100 kHz stream, 100 MHz capture
+    command_send_uint32(0x83, samples);                                // sample size
+    command_send_uint32(0x84, (samples - 4) / 4);                      // pre trigger size: none
+    command_send_uint32(0x82, flags);                                  // flags
+}
+
+static double elapsed_ns(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void complete_handler(void) {}
+
+static void output_hash(const uint8_t *data, uint length) {
+    // FNV-1a
+    for (uint i = 0; i < length; i++) output_hash_ = (output_hash_ ^ data[i]) * 16777619u;
+    if (output_length_ + length > output_max_) {
+        output_max_ = (output_length_ + length) * 2;
+        output_ = realloc(output_, output_max_);
+    }
+    memcpy(&output_[output_length_], data, length);
+    output_length_ += length;
+}
+
+static bool decode_check(const uint8_t *bytes, uint bytes_count) {
+    // The kept output: the records of the bus bytes in order, MISO records with the inverted MOSI byte, and the end
+    // record with the records count
+    uint records = output_length_ / DECODER_RECORD_SIZE, count = 0, miso_count = 0;
+    if (!records || output_length_ % DECODER_RECORD_SIZE) return false;
+    for (uint i = 0; i + 1 < records; i++) {
+        const uint8_t *record = &output_[i * DECODER_RECORD_SIZE];
+        uint data = record[4], flags = record[5];
+        if (flags & (DECODER_FLAG_ERROR | DECODER_FLAG_NACK)) return false;
+        if (flags & DECODER_FLAG_MISO) {
+            if (!count || data != (uint8_t)~bytes[count - 1]) return false;
+            miso_count++;
+        } else if (count >= bytes_count || data != bytes[count++]) {
+            return false;
+        }
+    }
+    const uint8_t *end = &output_[(records - 1) * DECODER_RECORD_SIZE];
+    uint end_count = end[0] | end[1] << 8 | end[2] << 16 | (uint)end[3] << 24;
+    return end[5] == DECODER_FLAG_END && end_count == records - 1 && count == bytes_count &&
+           (!miso_count || miso_count == count);
+}
+
+static bool frame_check(const uint16_t *trace, uint count, uint mask) {
+    // Decode the kept output and compare the samples with the trace channels
+    frame_capture_t capture = {.samples = malloc(count * sizeof(uint32_t)), .samples_max = count};
+    int decoded = frame_decode(&capture, output_, output_length_);
+    bool is_valid = decoded == (int)output_length_ && capture.is_complete && capture.samples_count == count;
+    for (uint i = 0; i < capture.samples_count && is_valid; i++)
+        if (capture.samples[i] != (trace[i] & mask)) is_valid = false;
+    free(capture.samples);
+    return is_valid;
+}
+
+static void output_keep_tail(const uint8_t *data, uint length) {
+    for (uint i = 0; i < length; i++) {
+        memmove(output_tail_, &output_tail_[1], sizeof(output_tail_) - 1);
+        output_tail_[sizeof(output_tail_) - 1] = data[i];
+    }
+}
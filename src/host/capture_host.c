@@ -0,0 +1,204 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replay capture backend. A capture completes immediately, returning the samples of the trace set with
+// capture_host_set_trace() or loaded from a file, packed to the enabled channels width as the firmware does. A stream
+// returns the trace in blocks, repeated as needed. A transition capture returns the changes of the trace
+
+#include "capture_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STREAM_BLOCK_SIZE 2048
+
+static const uint16_t *trace_;
+static uint16_t *trace_file_ = NULL;
+static uint32_t *buffer_ = NULL;
+static uint trace_count_, samples_count_, pre_trigger_count_, stream_position_, stream_remaining_, sample_width_,
+    sample_base_;
+static bool is_spans_enabled_ = true;
+static complete_handler_t handler_ = NULL;
+static capture_transition_t *transitions_ = NULL;
+static uint transitions_count_;
+
+static void pack_trace(uint channel_mask);
+static void set_transitions(uint rate);
+
+void capture_host_set_trace(const uint16_t *samples, uint count) {
+    trace_ = samples;
+    trace_count_ = count;
+    free(buffer_);
+    buffer_ = malloc((count + 1) * sizeof(uint32_t));
+    pack_trace(0xffff);
+}
+
+uint capture_host_load_trace(const char *path) {
+    // Samples of 16 bits, little endian
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint count = size > 0 ? size / 2 : 0;
+    uint8_t *data = malloc(count * 2 + 1);
+    if (fread(data, 2, count, file) != count) count = 0;
+    fclose(file);
+    free(trace_file_);
+    trace_file_ = malloc(count * sizeof(uint16_t) + 1);
+    for (uint i = 0; i < count; i++) trace_file_[i] = data[i * 2] | data[i * 2 + 1] << 8;
+    free(data);
+    capture_host_set_trace(trace_file_, count);
+    return count;
+}
+
+void capture_host_set_spans_enabled(bool is_enabled) { is_spans_enabled_ = is_enabled; }
+
+static void replay_init(uint pin_base, uint pin_count, complete_handler_t handler) {
+    (void)pin_base;
+    (void)pin_count;
+    handler_ = handler;
+}
+
+static void replay_start(uint samples, uint rate, uint pre_trigger_samples) {
+    (void)rate;
+    if (capture_config_.mode == CAPTURE_MODE_STREAM) {
+        stream_position_ = 0;
+        stream_remaining_ = samples;
+        return;
+    }
+    if (pre_trigger_samples > samples) pre_trigger_samples = samples;
+    pack_trace(capture_config_.channel_mask);
+    samples_count_ = samples < trace_count_ ? samples : trace_count_;
+    pre_trigger_count_ = pre_trigger_samples < samples_count_ ? pre_trigger_samples : samples_count_;
+    transitions_count_ = 0;
+    if (capture_config_.mode == CAPTURE_MODE_TRANSITION) {
+        pre_trigger_count_ = 0;
+        set_transitions(rate);
+    }
+    if (handler_) handler_();
+}
+
+static void replay_abort(void) {}
+
+static bool replay_is_busy(void) { return false; }
+
+static uint replay_get_sample_index(int index) {
+    if (index < 0 || (uint)index >= samples_count_) return 0;
+    uint bits = 5 - __builtin_ctz(sample_width_);
+    uint shift = (index & ((1u << bits) - 1)) * sample_width_;
+    return ((buffer_[index >> bits] >> shift) & ((1u << sample_width_) - 1)) << sample_base_;
+}
+
+static uint replay_get_samples_count(void) { return samples_count_; }
+
+static uint replay_get_capture_rate(void) { return capture_config_.rate; }
+
+static uint replay_get_capture_spans(capture_span_t spans[CAPTURE_SPANS_MAX]) {
+    if (!is_spans_enabled_ || !samples_count_ || capture_config_.mode == CAPTURE_MODE_TRANSITION) return 0;
+    spans[0] = (capture_span_t){buffer_, 0, samples_count_, sample_width_, sample_base_};
+    return 1;
+}
+
+static uint replay_get_max_samples(uint channel_mask, capture_mode_t mode) {
+    (void)channel_mask;
+    (void)mode;
+    return trace_count_;
+}
+
+static uint replay_get_rle_max_rate(uint channel_mask) {
+    (void)channel_mask;
+    return 0xffffffff;
+}
+
+static uint replay_stream_get_block(const uint16_t **samples) {
+    if (!stream_remaining_ || !trace_count_) return 0;
+    uint count = STREAM_BLOCK_SIZE;
+    if (count > trace_count_ - stream_position_) count = trace_count_ - stream_position_;
+    if (count > stream_remaining_) count = stream_remaining_;
+    *samples = &trace_[stream_position_];
+    return count;
+}
+
+static void replay_stream_release_block(void) {
+    const uint16_t *samples;
+    uint count = replay_stream_get_block(&samples);
+    stream_position_ = (stream_position_ + count) % trace_count_;
+    stream_remaining_ -= count;
+}
+
+static bool replay_stream_is_overrun(void) { return false; }
+
+static uint replay_get_pre_trigger_count(void) { return pre_trigger_count_; }
+
+static uint replay_get_transitions_count(void) { return transitions_count_; }
+
+static bool replay_get_transition(uint index, capture_transition_t *transition) {
+    if (index >= transitions_count_) return false;
+    *transition = transitions_[index];
+    return true;
+}
+
+static void set_transitions(uint rate) {
+    // A transition at each change of the captured channels, timed in sys clock cycles as the firmware does
+    uint cycles_per_sample = rate ? (SYS_CLOCK_KHZ * 1000 + rate / 2) / rate : 1;
+    if (!cycles_per_sample) cycles_per_sample = 1;
+    free(transitions_);
+    transitions_ = malloc((samples_count_ + 1) * sizeof(capture_transition_t));
+    for (uint i = 0; i < samples_count_; i++) {
+        uint value = replay_get_sample_index(i);
+        if (transitions_count_ && value == transitions_[transitions_count_ - 1].value) continue;
+        transitions_[transitions_count_++] = (capture_transition_t){value, i, (uint64_t)i * cycles_per_sample};
+    }
+}
+
+static void pack_trace(uint channel_mask) {
+    // Same sample width as the firmware: lowest to highest enabled channel, rounded up to a power of two
+    channel_mask &= 0xffff;
+    if (!channel_mask) channel_mask = 0xffff;
+    uint base = __builtin_ctz(channel_mask);
+    uint span = 32 - __builtin_clz(channel_mask) - base;
+    uint width = 1;
+    while (width < span) width <<= 1;
+    if (base + width > 16) base = 16 - width;
+    sample_width_ = width;
+    sample_base_ = base;
+
+    uint bits = 5 - __builtin_ctz(width);
+    for (uint i = 0; i <= trace_count_ >> bits; i++) buffer_[i] = 0;
+    for (uint i = 0; i < trace_count_; i++)
+        buffer_[i >> bits] |= ((trace_[i] >> base) & ((1u << width) - 1)) << ((i & ((1u << bits) - 1)) * width);
+}
+
+const capture_backend_t capture_backend_replay = {.name = "replay",
+                                                  .init = replay_init,
+                                                  .start = replay_start,
+                                                  .abort = replay_abort,
+                                                  .is_busy = replay_is_busy,
+                                                  .get_sample_index = replay_get_sample_index,
+                                                  .get_samples_count = replay_get_samples_count,
+                                                  .get_capture_rate = replay_get_capture_rate,
+                                                  .get_capture_spans = replay_get_capture_spans,
+                                                  .get_max_samples = replay_get_max_samples,
+                                                  .get_rle_max_rate = replay_get_rle_max_rate,
+                                                  .stream_get_block = replay_stream_get_block,
+                                                  .stream_release_block = replay_stream_release_block,
+                                                  .stream_is_overrun = replay_stream_is_overrun,
+                                                  .get_pre_trigger_count = replay_get_pre_trigger_count,
+                                                  .get_transitions_count = replay_get_transitions_count,
+                                                  .get_transition = replay_get_transition};
@@ -0,0 +1,49 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_HOST_H
+#define CAPTURE_HOST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "capture.h"
+
+// Host capture backends: replay of a trace (memory or file) and synthetic patterns
+extern const capture_backend_t capture_backend_replay;
+extern const capture_backend_t capture_backend_synthetic;
+
+typedef enum synthetic_pattern_t {
+    SYNTHETIC_PATTERN_COUNTER,  // binary counter, channel n toggles every 2^n samples
+    SYNTHETIC_PATTERN_CLOCK,    // channel 0 clock of 8 samples, channels 1-15 data changing on the falling edge
+    SYNTHETIC_PATTERN_WALKING,  // walking one
+    SYNTHETIC_PATTERN_RANDOM,
+    SYNTHETIC_PATTERN_COUNT
+} synthetic_pattern_t;
+
+void capture_host_set_trace(const uint16_t *samples, uint count);
+uint capture_host_load_trace(const char *path);
+void capture_host_set_spans_enabled(bool is_enabled);
+void capture_synthetic_set_pattern(synthetic_pattern_t pattern);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
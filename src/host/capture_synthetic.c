@@ -0,0 +1,174 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Synthetic capture backend. Samples are computed from their index, so captures of any size use no sample memory. The
+// first trigger is searched in the pattern and the capture window is placed around it. A stream returns the pattern in
+// blocks
+
+#include "capture_host.h"
+
+#define SYNTHETIC_MAX_SAMPLES (1u << 24)
+#define STREAM_BLOCK_SIZE 2048
+
+static synthetic_pattern_t pattern_ = SYNTHETIC_PATTERN_COUNTER;
+static uint samples_count_, pre_trigger_count_, offset_, channel_mask_, stream_position_, stream_remaining_;
+static int trigger_index_;
+static uint16_t stream_block_[STREAM_BLOCK_SIZE];
+static complete_handler_t handler_ = NULL;
+
+static inline uint get_pattern_sample(uint index);
+static inline uint hash(uint value);
+static inline int find_trigger(uint first);
+
+void capture_synthetic_set_pattern(synthetic_pattern_t pattern) {
+    pattern_ = pattern < SYNTHETIC_PATTERN_COUNT ? pattern : SYNTHETIC_PATTERN_COUNTER;
+}
+
+static void synthetic_init(uint pin_base, uint pin_count, complete_handler_t handler) {
+    (void)pin_base;
+    (void)pin_count;
+    handler_ = handler;
+}
+
+static void synthetic_start(uint samples, uint rate, uint pre_trigger_samples) {
+    (void)rate;
+    channel_mask_ = capture_config_.channel_mask ? capture_config_.channel_mask : 0xffff;
+    if (capture_config_.mode == CAPTURE_MODE_STREAM) {
+        stream_position_ = 0;
+        stream_remaining_ = samples;
+        return;
+    }
+    samples_count_ = samples < SYNTHETIC_MAX_SAMPLES ? samples : SYNTHETIC_MAX_SAMPLES;
+    pre_trigger_count_ = pre_trigger_samples < samples_count_ ? pre_trigger_samples : samples_count_;
+    offset_ = 0;
+    trigger_index_ = -1;
+    int trigger = find_trigger(pre_trigger_count_);
+    if (trigger >= 0) {
+        offset_ = trigger - pre_trigger_count_;
+        trigger_index_ = pre_trigger_count_;
+    }
+    if (handler_) handler_();
+}
+
+static void synthetic_abort(void) { stream_remaining_ = 0; }
+
+static bool synthetic_is_busy(void) { return false; }
+
+static uint synthetic_get_sample_index(int index) {
+    if (index < 0 || (uint)index >= samples_count_) return 0;
+    return get_pattern_sample(offset_ + index);
+}
+
+static uint synthetic_get_samples_count(void) { return samples_count_; }
+
+static uint synthetic_get_capture_rate(void) { return capture_config_.rate; }
+
+static uint synthetic_get_capture_spans(capture_span_t spans[CAPTURE_SPANS_MAX]) {
+    (void)spans;
+    return 0;
+}
+
+static uint synthetic_get_max_samples(uint channel_mask, capture_mode_t mode) {
+    (void)channel_mask;
+    (void)mode;
+    return SYNTHETIC_MAX_SAMPLES;
+}
+
+static uint synthetic_stream_get_block(const uint16_t **samples) {
+    if (!stream_remaining_) return 0;
+    uint count = stream_remaining_ < STREAM_BLOCK_SIZE ? stream_remaining_ : STREAM_BLOCK_SIZE;
+    for (uint i = 0; i < count; i++) stream_block_[i] = get_pattern_sample(stream_position_ + i);
+    *samples = stream_block_;
+    return count;
+}
+
+static void synthetic_stream_release_block(void) {
+    uint count = stream_remaining_ < STREAM_BLOCK_SIZE ? stream_remaining_ : STREAM_BLOCK_SIZE;
+    stream_position_ += count;
+    stream_remaining_ -= count;
+}
+
+static bool synthetic_stream_is_overrun(void) { return false; }
+
+static uint synthetic_get_pre_trigger_count(void) { return pre_trigger_count_; }
+
+static int synthetic_get_triggered_channel(void) { return trigger_index_ < 0 ? -1 : 0; }
+
+static int synthetic_get_trigger_index(void) { return trigger_index_; }
+
+static inline uint get_pattern_sample(uint index) {
+    uint sample;
+    switch (pattern_) {
+        case SYNTHETIC_PATTERN_CLOCK:
+            sample = (hash(index >> 3) & 0xfffe) | ((index >> 2) & 1);
+            break;
+        case SYNTHETIC_PATTERN_WALKING:
+            sample = 1u << (index & 15);
+            break;
+        case SYNTHETIC_PATTERN_RANDOM:
+            sample = hash(index);
+            break;
+        default:
+            sample = index;
+            break;
+    }
+    return sample & channel_mask_;
+}
+
+static inline uint hash(uint value) {
+    value *= 0x9e3779b1;
+    value ^= value >> 15;
+    value *= 0x85ebca77;
+    value ^= value >> 13;
+    return value;
+}
+
+static inline int find_trigger(uint first) {
+    // First sample matching the first enabled trigger, with at least the pre trigger samples before it. Protocol
+    // triggers are not searched
+    const trigger_t *trigger = NULL;
+    for (uint i = 0; i < TRIGGERS_COUNT && !trigger; i++)
+        if (capture_config_.trigger[i].is_enabled && capture_config_.trigger[i].match <= TRIGGER_MATCH_EDGE)
+            trigger = &capture_config_.trigger[i];
+    if (!trigger) return -1;
+    for (uint index = first; index < SYNTHETIC_MAX_SAMPLES; index++) {
+        bool is_match = (get_pattern_sample(index) & trigger->mask) == trigger->value;
+        if (is_match && trigger->match == TRIGGER_MATCH_EDGE && index &&
+            (get_pattern_sample(index - 1) & trigger->mask) == trigger->value)
+            is_match = false;
+        if (is_match) return index;
+    }
+    return -1;
+}
+
+const capture_backend_t capture_backend_synthetic = {.name = "synthetic",
+                                                     .init = synthetic_init,
+                                                     .start = synthetic_start,
+                                                     .abort = synthetic_abort,
+                                                     .is_busy = synthetic_is_busy,
+                                                     .get_sample_index = synthetic_get_sample_index,
+                                                     .get_samples_count = synthetic_get_samples_count,
+                                                     .get_capture_rate = synthetic_get_capture_rate,
+                                                     .get_capture_spans = synthetic_get_capture_spans,
+                                                     .get_max_samples = synthetic_get_max_samples,
+                                                     .stream_get_block = synthetic_stream_get_block,
+                                                     .stream_release_block = synthetic_stream_release_block,
+                                                     .stream_is_overrun = synthetic_stream_is_overrun,
+                                                     .get_pre_trigger_count = synthetic_get_pre_trigger_count,
+                                                     .get_triggered_channel = synthetic_get_triggered_channel,
+                                                     .get_trigger_index = synthetic_get_trigger_index};
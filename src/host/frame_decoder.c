@@ -0,0 +1,148 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decodes a framed upload into 32 bit samples. Returns the bytes decoded, up to the end frame, or -1 if the frames are
+// not valid. A partial frame at the end of the data is left for the next call. Decoding stops after the info frame if
+// the capture samples do not fit in the samples buffer. Transitions are expanded to samples at the capture rate
+
+#include "frame_decoder.h"
+
+static int decode_data(frame_capture_t *capture, const uint8_t *payload, uint length);
+static int decode_transitions(frame_capture_t *capture, const uint8_t *payload, uint length);
+static inline void fill_samples(frame_capture_t *capture, uint64_t end);
+static inline void unpack_word(frame_capture_t *capture, uint32_t word, uint *index, uint end);
+static inline uint get_uint16(const uint8_t *data);
+static inline uint32_t get_uint32(const uint8_t *data);
+
+int frame_decode(frame_capture_t *capture, const uint8_t *data, uint length) {
+    uint position = 0;
+    while (!capture->is_complete && length - position >= FRAME_HEADER_SIZE) {
+        const uint8_t *header = &data[position];
+        uint payload_length = get_uint16(&header[2]);
+        if (header[0] != FRAME_SYNC) return -1;
+        if (length - position < FRAME_HEADER_SIZE + payload_length) break;
+        const uint8_t *payload = header + FRAME_HEADER_SIZE;
+        switch (header[1]) {
+            case FRAME_TYPE_INFO: {
+                uint32_t *words = (uint32_t *)&capture->info;
+                uint count = sizeof(capture->info) / sizeof(uint32_t);
+                if (payload_length < count * 4) return -1;
+                for (uint i = 0; i < count; i++) words[i] = get_uint32(&payload[i * 4]);
+                if (capture->info.version != FRAME_VERSION) return -1;
+                capture->samples_count = 0;
+                capture->transitions_count = 0;
+                capture->transition_time = 0;
+                capture->transition_value = 0;
+                // Let the caller size the samples buffer
+                if (capture->info.samples > capture->samples_max) return position + FRAME_HEADER_SIZE + payload_length;
+                break;
+            }
+            case FRAME_TYPE_SEGMENTS:
+                for (uint i = 0; i < payload_length / 4 && i < CAPTURE_SEGMENTS_MAX; i++)
+                    capture->segment_time[i] = get_uint32(&payload[i * 4]);
+                break;
+            case FRAME_TYPE_DATA:
+                if (decode_data(capture, payload, payload_length)) return -1;
+                break;
+            case FRAME_TYPE_TRANSITIONS:
+                if (decode_transitions(capture, payload, payload_length)) return -1;
+                break;
+            case FRAME_TYPE_END:
+                // The last transition lasts up to the last sample
+                if (capture->transitions_count) fill_samples(capture, capture->info.samples);
+                if (payload_length < 8 || get_uint32(payload) != capture->samples_count) return -1;
+                capture->status = get_uint32(&payload[4]);
+                capture->is_complete = true;
+                break;
+            default:  // unknown frames are skipped
+                break;
+        }
+        position += FRAME_HEADER_SIZE + payload_length;
+    }
+    return position;
+}
+
+static int decode_data(frame_capture_t *capture, const uint8_t *payload, uint length) {
+    uint width = capture->info.width;
+    if (length < FRAME_DATA_HEADER_SIZE || !width || width > 32 || (width & (width - 1))) return -1;
+    uint index = get_uint32(payload), end = index + get_uint16(&payload[4]);
+    if (index != capture->samples_count || end > capture->info.samples || end > capture->samples_max) return -1;
+    const uint8_t *block = payload + FRAME_DATA_HEADER_SIZE;
+    uint block_length = length - FRAME_DATA_HEADER_SIZE;
+
+    if (payload[6] == FRAME_ENCODING_RAW) {
+        for (uint i = 0; i + 4 <= block_length; i += 4) unpack_word(capture, get_uint32(&block[i]), &index, end);
+    } else if (payload[6] == FRAME_ENCODING_RLE) {
+        for (uint i = 0; i + FRAME_RLE_RUN_SIZE <= block_length; i += FRAME_RLE_RUN_SIZE) {
+            uint count = get_uint16(&block[i]);
+            uint32_t word = get_uint32(&block[i + 2]);
+            while (count--) unpack_word(capture, word, &index, end);
+        }
+    } else {
+        return -1;
+    }
+    if (index != end) return -1;
+    capture->samples_count = end;
+    return 0;
+}
+
+static int decode_transitions(frame_capture_t *capture, const uint8_t *payload, uint length) {
+    // Each transition is the value of the samples from the first one at or after its time
+    uint rate = capture->info.rate, clock = capture->info.clock, bytes = capture->info.width / 8;
+    if (length < FRAME_TRANSITIONS_HEADER_SIZE || !rate || !clock || !bytes) return -1;
+    if (get_uint32(payload) != capture->transitions_count) return -1;
+    uint count = get_uint16(&payload[4]), position = FRAME_TRANSITIONS_HEADER_SIZE;
+    uint64_t cycles_per_sample = (clock + rate / 2) / rate;
+    if (!cycles_per_sample) cycles_per_sample = 1;
+    for (uint i = 0; i < count; i++) {
+        uint64_t delta = 0;
+        uint shift = 0;
+        do {
+            if (position >= length || shift > 63) return -1;
+            delta |= (uint64_t)(payload[position] & 0x7f) << shift;
+            shift += 7;
+        } while (payload[position++] & 0x80);
+        if (length - position < bytes) return -1;
+        uint32_t value = 0;
+        for (uint j = 0; j < bytes; j++) value |= (uint32_t)payload[position++] << (8 * j);
+        capture->transition_time += delta;
+        fill_samples(capture, (capture->transition_time + cycles_per_sample - 1) / cycles_per_sample);
+        capture->transition_value = value << capture->info.base;
+        capture->transitions_count++;
+    }
+    return position == length ? 0 : -1;
+}
+
+static inline void fill_samples(frame_capture_t *capture, uint64_t end) {
+    // Samples up to the end have the value of the last transition
+    if (end > capture->info.samples) end = capture->info.samples;
+    if (end > capture->samples_max) end = capture->samples_max;
+    while (capture->samples_count < end) capture->samples[capture->samples_count++] = capture->transition_value;
+}
+
+static inline void unpack_word(frame_capture_t *capture, uint32_t word, uint *index, uint end) {
+    uint width = capture->info.width, mask = 0xffffffffu >> (32 - width);
+    for (uint shift = 0; shift < 32 && *index < end; shift += width)
+        capture->samples[(*index)++] = ((word >> shift) & mask) << capture->info.base;
+}
+
+static inline uint get_uint16(const uint8_t *data) { return data[0] | data[1] << 8; }
+
+static inline uint32_t get_uint32(const uint8_t *data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
@@ -0,0 +1,50 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Reference decoder of the framed upload protocol (see protocol_frame.h)
+
+#ifndef FRAME_DECODER_H
+#define FRAME_DECODER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "capture.h"
+#include "protocol_frame.h"
+
+typedef struct frame_capture_t {
+    frame_info_t info;
+    uint32_t segment_time[CAPTURE_SEGMENTS_MAX];
+    uint32_t *samples;  // samples shifted to their channels, oldest first
+    uint samples_max;
+    uint samples_count;  // samples decoded
+    uint status;         // capture status of the end frame
+    bool is_complete;
+    uint transitions_count;  // transitions decoded
+    uint64_t transition_time;
+    uint32_t transition_value;
+} frame_capture_t;
+
+int frame_decode(frame_capture_t *capture, const uint8_t *data, uint length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
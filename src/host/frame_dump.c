@@ -0,0 +1,81 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reference host decoder of the framed upload. Reads the device output of a framed upload from a file (or stdin) and
+ * prints the capture info and the samples, oldest first, one per line
+ *
+ * Usage: frame_dump [file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_decoder.h"
+
+#define READ_SIZE 65536
+
+int main(int argc, char **argv) {
+    FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!file) {
+        fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+        return 1;
+    }
+
+    // Decode the frames as they are read. The samples buffer is sized when the info frame is decoded
+    frame_capture_t capture = {0};
+    uint8_t *data = malloc(READ_SIZE + FRAME_HEADER_SIZE + 0xffff);
+    uint length = 0;
+    size_t count;
+    int result = 1;
+    while (!capture.is_complete && (count = fread(&data[length], 1, READ_SIZE, file)) > 0) {
+        length += count;
+        int decoded = frame_decode(&capture, data, length);
+        if (decoded >= 0 && capture.info.samples > capture.samples_max) {
+            capture.samples = realloc(capture.samples, capture.info.samples * sizeof(uint32_t));
+            capture.samples_max = capture.info.samples;
+            int next = frame_decode(&capture, &data[decoded], length - decoded);
+            decoded = next < 0 ? next : decoded + next;
+        }
+        if (decoded < 0) break;
+        length -= decoded;
+        memmove(data, &data[decoded], length);
+    }
+    if (file != stdin) fclose(file);
+
+    if (!capture.is_complete) {
+        fprintf(stderr, "Invalid or incomplete frames. Samples decoded: %u\n", capture.samples_count);
+    } else {
+        printf("# samples %u width %u base %u rate %u channels %u status 0x%02X\n", capture.info.samples,
+               capture.info.width, capture.info.base, capture.info.rate, capture.info.channels, capture.status);
+        if (capture.info.trigger_index != 0xffffffff)
+            printf("# trigger %u index %u latency %u\n", capture.info.triggered_channel, capture.info.trigger_index,
+                   capture.info.trigger_latency);
+        if (capture.info.clock)
+            printf("# transitions %u clock %u Hz\n", capture.transitions_count, capture.info.clock);
+        for (uint i = 0; i < capture.info.segments && i < CAPTURE_SEGMENTS_MAX; i++)
+            printf("# segment %u time %u us\n", i, capture.segment_time[i]);
+        int digits = capture.info.channels > 16 ? 8 : 4;
+        for (uint i = 0; i < capture.samples_count; i++) printf("%u 0x%0*X\n", i, digits, capture.samples[i]);
+        result = 0;
+    }
+    free(capture.samples);
+    free(data);
+    return result;
+}
@@ -0,0 +1,41 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host mock of the pico SDK gpio functions. Inputs read as set by mock_gpio_set()
+
+#ifndef MOCK_HARDWARE_GPIO_H
+#define MOCK_HARDWARE_GPIO_H
+
+#include "pico/types.h"
+
+enum gpio_function { GPIO_FUNC_UART = 2, GPIO_FUNC_SIO = 5, GPIO_FUNC_PIO0 = 6, GPIO_FUNC_PIO1 = 7 };
+
+#define GPIO_OUT 1
+#define GPIO_IN 0
+
+void gpio_init(uint gpio);
+void gpio_init_mask(uint gpio_mask);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_dir_masked(uint32_t mask, uint32_t value);
+void gpio_pull_up(uint gpio);
+void gpio_pull_down(uint gpio);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+bool gpio_get(uint gpio);
+void gpio_put(uint gpio, bool value);
+
+#endif
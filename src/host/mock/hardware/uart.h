@@ -0,0 +1,37 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host mock of the pico SDK uart functions. Output goes to stderr
+
+#ifndef MOCK_HARDWARE_UART_H
+#define MOCK_HARDWARE_UART_H
+
+#include "pico/types.h"
+
+typedef struct uart_inst uart_inst_t;
+
+#define uart0 ((uart_inst_t *)0)
+
+uint uart_init(uart_inst_t *uart, uint baudrate);
+void uart_set_fifo_enabled(uart_inst_t *uart, bool enabled);
+void uart_puts(uart_inst_t *uart, const char *s);
+bool uart_is_writable(uart_inst_t *uart);
+void uart_putc_raw(uart_inst_t *uart, char c);
+void uart_tx_wait_blocking(uart_inst_t *uart);
+
+#endif
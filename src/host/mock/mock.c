@@ -0,0 +1,199 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mock.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "hardware/uart.h"
+#include "pico/multicore.h"
+#include "pico/stdio_usb.h"
+#include "pico/stdlib.h"
+
+#define MOCK_INPUT_BUFFER_SIZE 4096
+
+static uint8_t input_buffer_[MOCK_INPUT_BUFFER_SIZE];
+static uint input_head_, input_tail_;
+static uint64_t output_count_;
+static mock_output_handler_t output_handler_ = NULL;
+static void (*chars_available_callback_)(void *) = NULL;
+static void *chars_available_param_;
+static uint32_t gpio_state_, gpio_driven_, gpio_pull_up_;
+static pthread_t core1_thread_;
+static bool core1_is_running_ = false;
+
+static void usb_out_chars(const char *buf, int len);
+static void *core1_entry(void *entry);
+
+stdio_driver_t stdio_usb = {.out_chars = usb_out_chars};
+
+void mock_input_push(const uint8_t *data, uint length) {
+    for (uint i = 0; i < length; i++) {
+        input_buffer_[input_head_] = data[i];
+        input_head_ = (input_head_ + 1) % MOCK_INPUT_BUFFER_SIZE;
+    }
+    if (chars_available_callback_) chars_available_callback_(chars_available_param_);
+}
+
+void stdio_set_chars_available_callback(void (*fn)(void *), void *param) {
+    chars_available_callback_ = fn;
+    chars_available_param_ = param;
+}
+
+uint mock_input_available(void) {
+    return (input_head_ + MOCK_INPUT_BUFFER_SIZE - input_tail_) % MOCK_INPUT_BUFFER_SIZE;
+}
+
+void mock_output_set_handler(mock_output_handler_t handler) { output_handler_ = handler; }
+
+uint64_t mock_output_count(void) { return output_count_; }
+
+void mock_output_reset(void) { output_count_ = 0; }
+
+void mock_gpio_set(uint gpio, bool value) {
+    gpio_driven_ |= 1u << gpio;
+    if (value)
+        gpio_state_ |= 1u << gpio;
+    else
+        gpio_state_ &= ~(1u << gpio);
+}
+
+int mock_putchar(int c) {
+    uint8_t value = c;
+    output_count_++;
+    if (output_handler_) output_handler_(&value, 1);
+    return c;
+}
+
+int mock_printf(const char *format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length > (int)sizeof(buffer) - 1) length = sizeof(buffer) - 1;
+    if (length > 0) usb_out_chars(buffer, length);
+    return length;
+}
+
+int getchar_timeout_us(uint32_t timeout_us) {
+    (void)timeout_us;
+    if (input_tail_ == input_head_) return PICO_ERROR_TIMEOUT;
+    int c = input_buffer_[input_tail_];
+    input_tail_ = (input_tail_ + 1) % MOCK_INPUT_BUFFER_SIZE;
+    return c;
+}
+
+uint64_t time_us_64(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t time_us_32(void) { return (uint32_t)time_us_64(); }
+
+void sleep_ms(uint32_t ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+void gpio_init(uint gpio) { (void)gpio; }
+
+void gpio_init_mask(uint gpio_mask) { (void)gpio_mask; }
+
+void gpio_set_dir(uint gpio, bool out) {
+    (void)gpio;
+    (void)out;
+}
+
+void gpio_set_dir_masked(uint32_t mask, uint32_t value) {
+    (void)mask;
+    (void)value;
+}
+
+void gpio_pull_up(uint gpio) { gpio_pull_up_ |= 1u << gpio; }
+
+void gpio_pull_down(uint gpio) { gpio_pull_up_ &= ~(1u << gpio); }
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+    (void)gpio;
+    (void)fn;
+}
+
+bool gpio_get(uint gpio) {
+    // Undriven pins read as their pull
+    uint32_t state = (gpio_state_ & gpio_driven_) | (gpio_pull_up_ & ~gpio_driven_);
+    return (state >> gpio) & 1;
+}
+
+void gpio_put(uint gpio, bool value) { mock_gpio_set(gpio, value); }
+
+uint uart_init(uart_inst_t *uart, uint baudrate) {
+    (void)uart;
+    return baudrate;
+}
+
+void uart_set_fifo_enabled(uart_inst_t *uart, bool enabled) {
+    (void)uart;
+    (void)enabled;
+}
+
+void uart_puts(uart_inst_t *uart, const char *s) {
+    (void)uart;
+    fputs(s, stderr);
+}
+
+void uart_tx_wait_blocking(uart_inst_t *uart) { (void)uart; }
+
+bool uart_is_writable(uart_inst_t *uart) {
+    (void)uart;
+    return true;
+}
+
+void uart_putc_raw(uart_inst_t *uart, char c) {
+    (void)uart;
+    fputc(c, stderr);
+}
+
+uint get_core_num(void) { return core1_is_running_ && pthread_equal(pthread_self(), core1_thread_); }
+
+void multicore_launch_core1(void (*entry)(void)) {
+    multicore_reset_core1();
+    core1_is_running_ = pthread_create(&core1_thread_, NULL, core1_entry, (void *)entry) == 0;
+}
+
+void multicore_reset_core1(void) {
+    // The thread cannot be stopped at any point as core1 is. Core1 code must return when asked to stop
+    if (core1_is_running_) pthread_join(core1_thread_, NULL);
+    core1_is_running_ = false;
+}
+
+static void *core1_entry(void *entry) {
+    ((void (*)(void))entry)();
+    return NULL;
+}
+
+static void usb_out_chars(const char *buf, int len) {
+    output_count_ += len;
+    if (output_handler_) output_handler_((const uint8_t *)buf, len);
+}
@@ -0,0 +1,46 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Control interface of the host mocks: input queue for getchar_timeout_us() and output sink for stdio
+
+#ifndef MOCK_H
+#define MOCK_H
+
+#include "pico/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*mock_output_handler_t)(const uint8_t *data, uint length);
+
+void mock_input_push(const uint8_t *data, uint length);
+uint mock_input_available(void);
+void mock_output_set_handler(mock_output_handler_t handler);
+uint64_t mock_output_count(void);
+void mock_output_reset(void);
+void mock_gpio_set(uint gpio, bool value);
+
+int mock_putchar(int c);
+int mock_printf(const char *format, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
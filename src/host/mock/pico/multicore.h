@@ -0,0 +1,29 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host mock of the pico SDK multicore functions. Core1 runs in a thread
+
+#ifndef MOCK_PICO_MULTICORE_H
+#define MOCK_PICO_MULTICORE_H
+
+#include "pico/types.h"
+
+void multicore_launch_core1(void (*entry)(void));
+void multicore_reset_core1(void);
+
+#endif
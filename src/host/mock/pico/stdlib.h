@@ -0,0 +1,48 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host mock of the pico SDK stdlib. stdio output is redirected to the mock USB sink and input is read from the
+// mock input queue (see mock.h). Pushed input calls the chars available callback
+
+#ifndef MOCK_PICO_STDLIB_H
+#define MOCK_PICO_STDLIB_H
+
+#include <sched.h>
+#include <stdio.h>
+
+#include "hardware/gpio.h"
+#include "hardware/uart.h"
+#include "mock.h"
+#include "pico/types.h"
+
+#define PICO_ERROR_TIMEOUT -1
+#define PICO_DEFAULT_LED_PIN 25
+
+#define putchar(c) mock_putchar(c)
+#define printf(...) mock_printf(__VA_ARGS__)
+
+int getchar_timeout_us(uint32_t timeout_us);
+void stdio_set_chars_available_callback(void (*fn)(void *), void *param);
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+void sleep_ms(uint32_t ms);
+
+// Spin loops yield, so both cores make progress on single CPU hosts
+static inline void tight_loop_contents(void) { sched_yield(); }
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Virtual device. Runs the command and upload stack of the firmware on a pseudo-terminal, with a host capture backend,
+ * so SUMP hosts (sigrok, PulseView) and the framed upload can be used without a device
+ *
+ * Usage: virtual_device [synthetic [counter|clock|walking|random] | replay file]
+ *   sigrok-cli -d ols:conn=/dev/pts/N --samples 1000 -o capture.sr
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "capture_host.h"
+#include "common.h"
+#include "mock.h"
+#include "protocol_sump.h"
+
+#define IDLE_WAIT_MS 10
+
+config_t config_;
+capture_config_t capture_config_;
+counters_t counters_;
+
+static char debug_message_[DEBUG_BUFFER_SIZE];
+static const char *pattern_name_[SYNTHETIC_PATTERN_COUNT] = {"counter", "clock", "walking", "random"};
+static int pty_;
+static volatile bool send_samples_ = false;
+
+static void pty_receive(int timeout_ms);
+static void pty_write(const uint8_t *data, uint length);
+static void complete_handler(void);
+
+int main(int argc, char **argv) {
+    const capture_backend_t *backend = &capture_backend_synthetic;
+    if (argc > 1 && !strcmp(argv[1], "replay")) {
+        if (argc < 3 || !capture_host_load_trace(argv[2])) {
+            fprintf(stderr, "Cannot read samples file (16 bit samples, little endian)\n");
+            return 1;
+        }
+        backend = &capture_backend_replay;
+    } else if (argc > 1 && strcmp(argv[1], "synthetic")) {
+        fprintf(stderr, "Usage: %s [synthetic [counter|clock|walking|random] | replay file]\n", argv[0]);
+        return 1;
+    } else if (argc > 2) {
+        for (uint i = 0; i < SYNTHETIC_PATTERN_COUNT; i++)
+            if (!strcmp(argv[2], pattern_name_[i])) capture_synthetic_set_pattern(i);
+    }
+
+    // Raw pseudo-terminal. The slave is kept open so the master is not closed between host connections
+    pty_ = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty_ < 0 || grantpt(pty_) || unlockpt(pty_)) {
+        perror("Pseudo-terminal");
+        return 1;
+    }
+    int slave = open(ptsname(pty_), O_RDWR | O_NOCTTY);
+    struct termios termios;
+    if (slave < 0 || tcgetattr(slave, &termios)) {
+        perror("Pseudo-terminal");
+        return 1;
+    }
+    cfmakeraw(&termios);
+    tcsetattr(slave, TCSANOW, &termios);
+    printf("Virtual device (%s backend): %s\n", backend->name, ptsname(pty_));
+    fflush(stdout);
+
+    mock_output_set_handler(pty_write);
+    config_.channels = capture_config_.channels = CHANNEL_COUNT;
+    config_.trigger_edge = true;
+    debug_init(115200, &debug_message_[0], &config_.debug);
+    capture_set_backend(backend);
+    capture_init(0, capture_config_.channels, complete_handler);
+    sump_init();
+
+    while (true) {
+        debug_task();
+        command_t command = sump_read();
+        if (command == COMMAND_CAPTURE) {
+            capture_start(capture_config_.total_samples, capture_config_.rate, capture_config_.pre_trigger_samples);
+            if (capture_config_.mode == CAPTURE_MODE_STREAM) {
+                sump_send_stream();
+                continue;
+            }
+        } else if (command == COMMAND_RESET) {
+            if (capture_is_busy()) capture_abort();
+            sump_reset();
+        } else if (command == COMMAND_NONE && !send_samples_) {
+            pty_receive(IDLE_WAIT_MS);
+        }
+        if (send_samples_) {
+            sump_send_samples();
+            send_samples_ = false;
+        }
+    }
+}
+
+static void pty_receive(int timeout_ms) {
+    // Received bytes are pushed to the mock stdio input, which calls the receive callback as the USB interrupt does
+    struct pollfd fd = {.fd = pty_, .events = POLLIN};
+    uint8_t data[256];
+    if (poll(&fd, 1, timeout_ms) <= 0 || !(fd.revents & POLLIN)) return;
+    ssize_t count = read(pty_, data, sizeof(data));
+    if (count > 0) mock_input_push(data, count);
+}
+
+static void pty_write(const uint8_t *data, uint length) {
+    // Blocks while the host does not read, as the USB link does. Commands are received meanwhile
+    pty_receive(0);
+    while (length) {
+        ssize_t count = write(pty_, data, length);
+        if (count <= 0) return;
+        data += count;
+        length -= count;
+    }
+}
+
+static void complete_handler(void) { send_samples_ = true; }
@@ -26,14 +26,16 @@ volatile bool send_samples_ = false;
 char debug_message_[DEBUG_BUFFER_SIZE];
 config_t config_;
 capture_config_t capture_config_;
+counters_t counters_;
 
 void capture(void);
 void complete_handler(void);
 void set_pin_config(void);
+void debug_counters(void);
 
 int main() {
     // init
-    if (clock_get_hz(clk_sys) != 100000000) set_sys_clock_khz(100000, true);
+    if (clock_get_hz(clk_sys) != SYS_CLOCK_KHZ * 1000) set_sys_clock_khz(SYS_CLOCK_KHZ, true);
     stdio_init_all();
     set_pin_config();
     config_.channels = capture_config_.channels = CHANNEL_COUNT;
@@ -53,17 +55,32 @@ int main() {
     sleep_ms(500);
     gpio_put(PICO_DEFAULT_LED_PIN, 0);
 
+    capture_set_backend(&capture_backend_pio);
     capture_init(0, capture_config_.channels, complete_handler);
+    sump_init();
 
     while (true) {
+        debug_task();
         command_t command = sump_read();
         if (command == COMMAND_CAPTURE) {
             gpio_put(PICO_DEFAULT_LED_PIN, 1);
             capture();
-            debug_block("\nCapture complete. Samples count: %u Pre trigger count: %u ", get_samples_count(),
-                        get_pre_trigger_count());
-            if (get_triggered_channel() != -1) debug_block("\nTriggered channel: %d", get_triggered_channel());
-            if (get_pre_trigger_count() < capture_config_.pre_trigger_samples)
+            if (capture_config_.mode == CAPTURE_MODE_STREAM) {
+                sump_send_stream();
+                debug_counters();
+                gpio_put(PICO_DEFAULT_LED_PIN, 0);
+                continue;
+            }
+            debug_block("\nCapture complete. Samples count: %u Pre trigger count: %u Rate: %u", get_samples_count(),
+                        get_pre_trigger_count(), get_capture_rate());
+            if (get_triggered_channel() != -1)
+                debug_block("\nTriggered by trigger: %d Trigger index: %d Latency: %u cycles", get_triggered_channel(),
+                            get_trigger_index(), get_trigger_latency());
+            if (get_capture_status() & CAPTURE_STATUS_STALLED)
+                debug_block("\nWarning. Capture FIFO stalled. Samples lost (status 0x%02X)", get_capture_status());
+            for (uint i = 0; i < get_segments_count(); i++)
+                debug_block("\nSegment %u Time: %u us", i, get_segment_time(i));
+            if (!get_segments_count() && get_pre_trigger_count() < capture_config_.pre_trigger_samples)
                 debug_block(
                     "\nWarning. Not enough pre trigger samples. Missing samples (%u) will be sent as 0x0000 samples",
                     capture_config_.pre_trigger_samples - get_pre_trigger_count());
@@ -73,11 +90,8 @@ int main() {
             gpio_put(PICO_DEFAULT_LED_PIN, 0);
         }
         if (send_samples_) {
-            if (clock_get_hz(clk_sys) != 100000000) {
-                set_sys_clock_khz(100000, true);
-                debug_reinit();
-            }
             sump_send_samples();
+            debug_counters();
             gpio_put(PICO_DEFAULT_LED_PIN, 0);
             send_samples_ = false;
         }
@@ -92,6 +106,14 @@ void complete_handler(void) {
     send_samples_ = true;
 }
 
+void debug_counters(void) {
+    debug(
+        "\nCounters. Arm: %u us Trigger to complete: %u us Samples: %u Pre trigger missing: %u Upload: %u bytes %u us",
+        counters_.arm_time, counters_.trigger_time, counters_.samples, counters_.pre_trigger_missing,
+        counters_.upload_bytes, counters_.upload_time);
+    debug("\nCounters. Stalls: %u Captures: %u Commands: %u", counters_.stalls, counters_.captures, counters_.commands);
+}
+
 void set_pin_config(void) {
     /*
      *   Connect GPIO to GND at boot to select/enable:
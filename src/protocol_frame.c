@@ -0,0 +1,268 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "protocol_frame.h"
+
+#include "capture.h"
+#include "pico/stdio_usb.h"
+#include "pico/stdlib.h"
+#include "protocol_sump.h"
+
+static bool is_enabled_ = false, is_aborted_;
+static uint8_t frame_buffer_[FRAME_HEADER_SIZE + FRAME_DATA_HEADER_SIZE + FRAME_BLOCK_WORDS * sizeof(uint32_t)];
+static uint32_t block_[FRAME_BLOCK_WORDS];
+static uint block_words_, block_first_, word_samples_, samples_per_word_, width_, send_bytes_;
+static uint32_t word_;
+
+static inline void send_info(uint samples, uint width, uint base, uint clock);
+static inline void send_segments(void);
+static inline void send_transitions(uint transitions_count, uint width);
+static inline void send_end(uint samples);
+static inline void send_frame(frame_type_t type, uint length);
+static inline void pack_span(const capture_span_t *span, uint skip);
+static inline void pack_sample(uint sample);
+static inline void pack_word(uint32_t word);
+static inline void pack_flush(void);
+static void send_block(uint samples);
+static inline uint encode_rle(uint8_t *buffer, uint max_length);
+static inline void put_uint16(uint8_t *buffer, uint value);
+static inline void put_uint32(uint8_t *buffer, uint32_t value);
+
+void frame_set_enabled(bool is_enabled) { is_enabled_ = is_enabled; }
+
+bool frame_is_enabled(void) { return is_enabled_; }
+
+void frame_send_samples(void) {
+    /*
+     * Oldest sample first. Captures stored as spans are sent at the capture sample width, a word at a time when the
+     * span is aligned to the block words. Otherwise (RLE captures) the samples are read one by one as 16 or 32 bit
+     * samples. Transition captures are sent as transitions frames with their sys clock times.
+     * Samples missing from the requested count are not sent: the info frame has the samples count
+     */
+
+    capture_span_t spans[CAPTURE_SPANS_MAX];
+    uint spans_count = get_capture_spans(spans);
+    uint samples = get_samples_count(), skip = 0;
+    if (samples > capture_config_.total_samples) {
+        skip = samples - capture_config_.total_samples;
+        samples = capture_config_.total_samples;
+    }
+    uint width = spans_count ? spans[0].width : capture_config_.channel_mask > 0xffff ? 32 : 16;
+    uint base = spans_count ? spans[0].base : 0;
+    uint transitions_count = get_transitions_count();
+
+    debug("\nSend frames. Samples: %u Width: %u", samples, width);
+    uint64_t start_time = time_us_64();
+    send_bytes_ = 0;
+    is_aborted_ = false;
+    width_ = width;
+    samples_per_word_ = 32 / width;
+    block_words_ = 0;
+    block_first_ = 0;
+    word_samples_ = 0;
+    word_ = 0;
+
+    send_info(samples, width, base, transitions_count ? SYS_CLOCK_KHZ * 1000 : 0);
+    if (get_segments_count()) send_segments();
+    if (transitions_count) {
+        send_transitions(transitions_count, width);
+    } else if (spans_count) {
+        for (uint i = 0; i < spans_count && !is_aborted_; i++) {
+            uint count = skip < spans[i].count ? skip : spans[i].count;
+            pack_span(&spans[i], count);
+            skip -= count;
+        }
+    } else {
+        for (uint i = skip; i < skip + samples && !is_aborted_; i++) pack_sample(get_sample_index(i));
+    }
+    if (!is_aborted_) pack_flush();
+    if (is_aborted_) {
+        debug("\nCapture aborted");
+        return;
+    }
+    send_end(samples);
+
+    uint64_t elapsed = time_us_64() - start_time;
+    counters_.upload_bytes = send_bytes_;
+    counters_.upload_time = elapsed;
+    debug("\nTransfer completed. Bytes: %u Time: %u us Rate: %u bytes/s", send_bytes_, (uint)elapsed,
+          elapsed ? (uint)((uint64_t)send_bytes_ * 1000000 / elapsed) : 0);
+}
+
+static inline void send_info(uint samples, uint width, uint base, uint clock) {
+    int trigger_index = get_trigger_index();
+    int skipped = get_samples_count() - samples;
+    frame_info_t info = {.version = FRAME_VERSION,
+                         .samples = samples,
+                         .width = width,
+                         .base = base,
+                         .rate = get_capture_rate(),
+                         .trigger_index = trigger_index < skipped ? 0xffffffffu : (uint32_t)(trigger_index - skipped),
+                         .triggered_channel = get_triggered_channel(),
+                         .trigger_latency = get_trigger_latency(),
+                         .status = get_capture_status(),
+                         .segments = get_segments_count(),
+                         .channels = capture_config_.channels,
+                         .clock = clock};
+    const uint32_t *words = (const uint32_t *)&info;
+    uint count = sizeof(info) / sizeof(uint32_t);
+    for (uint i = 0; i < count; i++) put_uint32(&frame_buffer_[FRAME_HEADER_SIZE + i * 4], words[i]);
+    send_frame(FRAME_TYPE_INFO, count * 4);
+}
+
+static inline void send_segments(void) {
+    uint count = get_segments_count();
+    for (uint i = 0; i < count; i++) put_uint32(&frame_buffer_[FRAME_HEADER_SIZE + i * 4], get_segment_time(i));
+    send_frame(FRAME_TYPE_SEGMENTS, count * 4);
+}
+
+static inline void send_transitions(uint transitions_count, uint width) {
+    // Transitions are added to the frame until the next one may not fit. A reset received aborts the upload between
+    // frames
+    uint8_t *header = &frame_buffer_[FRAME_HEADER_SIZE];
+    uint8_t *data = header + FRAME_TRANSITIONS_HEADER_SIZE;
+    uint length = 0, first = 0, bytes = width / 8;
+    uint64_t time = 0;
+    capture_transition_t transition;
+    for (uint i = 0; i < transitions_count && !is_aborted_; i++) {
+        if (!get_transition(i, &transition)) break;
+        uint64_t delta = transition.time - time;
+        time = transition.time;
+        do {
+            data[length++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+            delta >>= 7;
+        } while (delta);
+        for (uint j = 0; j < bytes; j++) data[length++] = transition.value >> (8 * j);
+        if (i + 1 == transitions_count || length > FRAME_BLOCK_WORDS * sizeof(uint32_t) - FRAME_TRANSITION_MAX_SIZE) {
+            put_uint32(header, first);
+            put_uint16(header + 4, i + 1 - first);
+            put_uint16(header + 6, 0);
+            send_frame(FRAME_TYPE_TRANSITIONS, FRAME_TRANSITIONS_HEADER_SIZE + length);
+            first = i + 1;
+            length = 0;
+            if (sump_is_reset_received()) is_aborted_ = true;
+        }
+    }
+}
+
+static inline void send_end(uint samples) {
+    put_uint32(&frame_buffer_[FRAME_HEADER_SIZE], samples);
+    put_uint32(&frame_buffer_[FRAME_HEADER_SIZE + 4], get_capture_status());
+    send_frame(FRAME_TYPE_END, 8);
+}
+
+static inline void send_frame(frame_type_t type, uint length) {
+    // The payload is already in the frame buffer. Hand the whole frame to the CDC driver
+    frame_buffer_[0] = FRAME_SYNC;
+    frame_buffer_[1] = type;
+    put_uint16(&frame_buffer_[2], length);
+    stdio_usb.out_chars((const char *)frame_buffer_, FRAME_HEADER_SIZE + length);
+    send_bytes_ += FRAME_HEADER_SIZE + length;
+}
+
+static inline void pack_span(const capture_span_t *span, uint skip) {
+    uint bits = 5 - __builtin_ctz(span->width), mask = 0xffffffffu >> (32 - span->width);
+    uint index = span->first + skip, end = span->first + span->count;
+    while (index < end && !is_aborted_) {
+        if (!(index & (samples_per_word_ - 1)) && !word_samples_ && end - index >= samples_per_word_) {
+            pack_word(span->buffer[index >> bits]);
+            index += samples_per_word_;
+            continue;
+        }
+        uint shift = (index & ((1u << bits) - 1)) * span->width;
+        pack_sample((span->buffer[index >> bits] >> shift) & mask);
+        index++;
+    }
+}
+
+static inline void pack_sample(uint sample) {
+    // Sample of the frame width, not shifted to the base channel
+    word_ |= sample << (word_samples_ * width_);
+    if (++word_samples_ == samples_per_word_) {
+        pack_word(word_);
+        word_samples_ = 0;
+        word_ = 0;
+    }
+}
+
+static inline void pack_word(uint32_t word) {
+    block_[block_words_++] = word;
+    if (block_words_ == FRAME_BLOCK_WORDS) send_block(FRAME_BLOCK_WORDS * samples_per_word_);
+}
+
+static inline void pack_flush(void) {
+    // Last word, partially filled
+    uint samples = block_words_ * samples_per_word_ + word_samples_;
+    if (word_samples_) block_[block_words_++] = word_;
+    word_samples_ = 0;
+    word_ = 0;
+    if (samples) send_block(samples);
+}
+
+static void send_block(uint samples) {
+    /*
+     * RLE encoding of the block words when it is smaller than the raw words. A reset received aborts the upload between
+     * frames
+     */
+
+    uint8_t *header = &frame_buffer_[FRAME_HEADER_SIZE];
+    uint8_t *data = header + FRAME_DATA_HEADER_SIZE;
+    uint length = block_words_ * sizeof(uint32_t);
+    uint rle_length = encode_rle(data, length);
+    put_uint32(header, block_first_);
+    put_uint16(header + 4, samples);
+    header[6] = rle_length ? FRAME_ENCODING_RLE : FRAME_ENCODING_RAW;
+    header[7] = 0;
+    if (rle_length) {
+        length = rle_length;
+    } else {
+        for (uint i = 0; i < block_words_; i++) put_uint32(&data[i * 4], block_[i]);
+    }
+    send_frame(FRAME_TYPE_DATA, FRAME_DATA_HEADER_SIZE + length);
+    block_first_ += samples;
+    block_words_ = 0;
+    if (sump_is_reset_received()) is_aborted_ = true;
+}
+
+static inline uint encode_rle(uint8_t *buffer, uint max_length) {
+    // Runs of equal words. Returns 0 if the runs are not smaller than max length
+    uint length = 0;
+    for (uint i = 0; i < block_words_;) {
+        uint32_t word = block_[i];
+        uint count = 1;
+        while (i + count < block_words_ && block_[i + count] == word && count < FRAME_RLE_MAX_COUNT) count++;
+        if (length + FRAME_RLE_RUN_SIZE >= max_length) return 0;
+        put_uint16(&buffer[length], count);
+        put_uint32(&buffer[length + 2], word);
+        length += FRAME_RLE_RUN_SIZE;
+        i += count;
+    }
+    return length;
+}
+
+static inline void put_uint16(uint8_t *buffer, uint value) {
+    buffer[0] = value;
+    buffer[1] = value >> 8;
+}
+
+static inline void put_uint32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = value;
+    buffer[1] = value >> 8;
+    buffer[2] = value >> 16;
+    buffer[3] = value >> 24;
+}
@@ -0,0 +1,95 @@
+/*
+ * Logic Analyzer RP2040-SUMP
+ * Copyright (C) 2023 Daniel Gorbea <danielgorbea@hotmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROTOCOL_FRAME_H
+#define PROTOCOL_FRAME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+/*
+ * Framed upload protocol. Selected with the handshake command byte, replied with the magic. A SUMP reset returns to the
+ * SUMP upload
+ *
+ * Frame: sync (1 byte), type (1 byte), payload length (2 bytes), payload. Little endian
+ * - Info: frame_info_t, as 32 bit words
+ * - Segments: trigger time of each segment (us), 32 bit words
+ * - Data: first sample (4 bytes), samples count (2 bytes), encoding (1 byte), reserved (1 byte), block. The block is
+ *   the samples packed in 32 bit words at the info sample width, oldest sample first and in the least significant bits.
+ *   Raw encoding: the words. RLE encoding: runs of equal words, count (2 bytes) and word (4 bytes)
+ * - Transitions: first transition (4 bytes), transitions count (2 bytes), reserved (2 bytes), transitions. Sent instead
+ *   of the data frames for transition captures, oldest first. Each transition is the time from the previous one in
+ *   info clock cycles (LEB128, the first one from the capture start) and the channels value (info width / 8 bytes)
+ * - End: samples sent (4 bytes) and capture status (4 bytes)
+ */
+
+#define FRAME_HANDSHAKE 0x46  // short command 'F'
+#define FRAME_MAGIC "FRM1"
+#define FRAME_VERSION 2
+#define FRAME_SYNC 0xA5
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_DATA_HEADER_SIZE 8
+#define FRAME_TRANSITIONS_HEADER_SIZE 8
+
+// Data frame block size in words. Up to 32768 samples of 1 bit
+#define FRAME_BLOCK_WORDS 1024
+
+#define FRAME_RLE_RUN_SIZE 6
+#define FRAME_RLE_MAX_COUNT 0xffff
+
+// Transition size: time up to 64 bits (10 bytes) and a 32 bit value
+#define FRAME_TRANSITION_MAX_SIZE 14
+
+typedef enum frame_type_t {
+    FRAME_TYPE_INFO = 1,
+    FRAME_TYPE_SEGMENTS = 2,
+    FRAME_TYPE_DATA = 3,
+    FRAME_TYPE_END = 4,
+    FRAME_TYPE_TRANSITIONS = 5
+} frame_type_t;
+
+typedef enum frame_encoding_t { FRAME_ENCODING_RAW, FRAME_ENCODING_RLE } frame_encoding_t;
+
+typedef struct frame_info_t {
+    uint32_t version;
+    uint32_t samples;
+    uint32_t width;  // sample width: 1, 2, 4, 8, 16 or 32 bits
+    uint32_t base;   // channel of the sample least significant bit
+    uint32_t rate;
+    uint32_t trigger_index;  // index of the trigger sample, 0xffffffff if not triggered
+    uint32_t triggered_channel;
+    uint32_t trigger_latency;
+    uint32_t status;
+    uint32_t segments;
+    uint32_t channels;
+    uint32_t clock;  // transitions time clock (Hz), 0 without transitions
+} frame_info_t;
+
+void frame_set_enabled(bool is_enabled);
+bool frame_is_enabled(void);
+void frame_send_samples(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,13 +19,17 @@
 #include "protocol_sump.h"
 
 #include "capture.h"
+#include "decoder.h"
 #include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+#include "pico/stdio_usb.h"
 #include "pico/stdlib.h"
+#include "protocol_frame.h"
 
 // Sump metadata
 #define DEVICE_NAME "RP2040"
 #define DEVICE_VERSION "v0.1"
-#define MAX_TOTAL_SAMPLES 200000   // bytes
 #define MAX_SAMPLE_RATE 200000000  // Hz. Maximum rate for sump protocol
 #define CLOCK_RATE \
     100000000  // Hz. This is required because clock divisor provided by libsigrok, is based on this value
@@ -34,6 +38,29 @@
 // Number of stages
 #define STAGES_COUNT 4
 
+// Sustained USB CDC throughput to the host until an upload has measured it. Streams above this byte rate are rejected
+#define STREAM_MAX_BYTE_RATE 800000  // bytes/s
+// Uploads shorter than this are not used to measure the throughput
+#define UPLOAD_RATE_MIN_TIME 100000  // us
+
+// Upload staging buffer size. Multiple of the USB full speed bulk packet size (64 bytes). Build with
+// -DSEND_BUFFER_SIZE=1 to measure the unbatched (byte per USB write) throughput
+#ifndef SEND_BUFFER_SIZE
+#define SEND_BUFFER_SIZE (64 * 4)
+#endif
+
+// Upload queue size in send buffers. Power of two
+#define UPLOAD_QUEUE_SIZE 8
+
+// Command receive ring size. Power of two
+#define COMMAND_RING_SIZE 256
+
+// Long commands are the command byte and a 32 bit value
+#define COMMAND_LONG_SIZE 5
+
+// A partial command is discarded when the rest of it is not received in this time
+#define COMMAND_TIMEOUT_US 100000
+
 // Trigger Config
 #define TRIGGER_START (1 << (3 + 24))
 #define TRIGGER_SERIAL (1 << (2 + 24))
@@ -42,6 +69,10 @@
 #define TRIGGER_LEVEL_MASK (3 << (0 + 24))
 #define TRIGGER_LEVEL(NUMBER) (NUMBER << (0 + 24))
 
+// Protocol trigger (vendor command): value in bits 0-7, enabled by bit 8
+#define PROTOCOL_TRIGGER_VALUE_MASK 0xff
+#define PROTOCOL_TRIGGER_ENABLE (1 << 8)
+
 typedef enum sump_flag_bits_t {
     FLAG_DEMUX_MODE = (1 << 0),
     FLAG_NOISE_FILTER = (1 << 1),
@@ -67,194 +98,489 @@ typedef struct sump_trigger_t {
     uint configuration;
 } sump_trigger_t;
 
-static uint divisor_, flags_;
+typedef struct sump_command_t {
+    uint8_t size;                                      // 1, or COMMAND_LONG_SIZE with a 32 bit value
+    uint (*handler)(uint8_t command, uint32_t value);  // returns a command_t
+} sump_command_t;
+
+typedef struct upload_block_t {
+    uint count;
+    uint8_t data[SEND_BUFFER_SIZE];
+} upload_block_t;
+
+static uint divisor_, flags_, channel_mask_ = (1u << CHANNEL_COUNT) - 1, segments_ = 4, protocol_trigger_;
+static capture_mode_t mode_ = CAPTURE_MODE_ONE_SHOT;
 static sump_trigger_t sump_trigger_[STAGES_COUNT];
+static uint8_t send_buffer_direct_[SEND_BUFFER_SIZE], *send_buffer_ = send_buffer_direct_;
+static uint send_buffer_count_, send_bytes_, upload_byte_rate_;
+
+// Upload pipeline: core1 encodes the samples into the queue blocks (single producer), core0 sends them to the host
+// (single consumer). Head and tail are only written by the producer and the consumer respectively
+static upload_block_t upload_queue_[UPLOAD_QUEUE_SIZE];
+static volatile uint upload_head_, upload_tail_;
+static volatile bool upload_is_done_, upload_is_aborted_;
+static bool is_upload_queued_ = false;
+static uint decoder_records_;
+
+// Command receive ring: written by the stdio receive callback (USB interrupt), read by sump_read() when a whole
+// command is received. A reset received as a command byte is flagged at once for the upload paths
+static uint8_t command_ring_[COMMAND_RING_SIZE];
+static volatile uint command_head_, command_tail_;
+static volatile bool is_reset_received_ = false, is_receive_stalled_ = false;
+static uint receive_value_count_;
+static uint64_t command_time_;
 
 static inline void prepare_adquisition(void);
+static inline void prepare_mode(void);
+static inline void set_upload_byte_rate(void);
+static inline uint get_bytes_per_sample(void);
+static inline uint get_channel_mask(void);
+static inline uint get_channelgroup_mask(void);
 static inline void send_sample(uint sample);
 static inline void send_sample_rle(uint sample, uint count);
+static inline void send_byte(uint8_t value);
+static inline void send_flush(void);
+static bool upload_run(void (*encoder)(void));
+static void upload_encoder(void);
+static void upload_decoder(void);
+static void send_record(const decoder_record_t *record);
+static inline void send_decoded(void);
+static inline void send_spans(const capture_span_t *spans, uint spans_count, uint skip, uint padding);
+static inline void send_spans_rle(const capture_span_t *spans, uint spans_count, uint skip, uint padding,
+                                  uint channelgroup_mask, uint rle_max_count);
+static inline void send_run(uint sample, uint count, uint rle_max_count);
+static inline void send_transitions(uint transitions_count, uint skip, uint padding, uint channelgroup_mask,
+                                    uint rle_max_count);
+static inline void send_transition_run(uint sample, uint count, uint rle_max_count);
+static inline void upload_push(void);
+static void command_receive(void *param);
+static inline int command_get(void);
+static inline uint8_t command_get_byte(void);
 static inline uint32_t get_uint32(void);
 static inline void put_uint32(uint32_t value);
+static inline uint get_command_size(uint8_t command);
+static uint command_reset(uint8_t command, uint32_t value);
+static uint command_run(uint8_t command, uint32_t value);
+static uint command_id(uint8_t command, uint32_t value);
+static uint command_frame_handshake(uint8_t command, uint32_t value);
+static uint command_metadata(uint8_t command, uint32_t value);
+static uint command_trigger_mask(uint8_t command, uint32_t value);
+static uint command_trigger_values(uint8_t command, uint32_t value);
+static uint command_trigger_configuration(uint8_t command, uint32_t value);
+static uint command_divisor(uint8_t command, uint32_t value);
+static uint command_sizes(uint8_t command, uint32_t value);
+static uint command_flags(uint8_t command, uint32_t value);
+static uint command_sample_size(uint8_t command, uint32_t value);
+static uint command_pre_trigger_size(uint8_t command, uint32_t value);
+static uint command_capture_mode(uint8_t command, uint32_t value);
+static uint command_channel_mask(uint8_t command, uint32_t value);
+static uint command_self_test(uint8_t command, uint32_t value);
+static uint command_segments(uint8_t command, uint32_t value);
+static uint command_segment_times(uint8_t command, uint32_t value);
+static uint command_counters(uint8_t command, uint32_t value);
+static uint command_capture_status(uint8_t command, uint32_t value);
+static uint command_benchmark(uint8_t command, uint32_t value);
+static uint command_decoder(uint8_t command, uint32_t value);
+static uint command_decoder_baud_rate(uint8_t command, uint32_t value);
+static uint command_decode(uint8_t command, uint32_t value);
+static uint command_protocol_trigger(uint8_t command, uint32_t value);
+
+// Command table: size and handler of each command. Commands without a handler are ignored, with the SUMP size: long
+// commands have the most significant bit set
+static const sump_command_t command_table_[256] = {
+    [0x00] = {1, command_reset},                                  // reset
+    [0x01] = {1, command_run},                                    // run
+    [0x02] = {1, command_id},                                     // send id
+    [FRAME_HANDSHAKE] = {1, command_frame_handshake},             // framed upload
+    [0x04] = {1, command_metadata},                               // send metadata
+    [0x80] = {COMMAND_LONG_SIZE, command_divisor},                // divisor
+    [0x81] = {COMMAND_LONG_SIZE, command_sizes},                  // sample size & pre trigger size
+    [0x82] = {COMMAND_LONG_SIZE, command_flags},                  // flags
+    [0x83] = {COMMAND_LONG_SIZE, command_sample_size},            // sample size
+    [0x84] = {COMMAND_LONG_SIZE, command_pre_trigger_size},       // pre trigger size
+    [0xA0] = {COMMAND_LONG_SIZE, command_capture_mode},           // vendor: capture mode
+    [0xA1] = {COMMAND_LONG_SIZE, command_channel_mask},           // vendor: channels in use
+    [0xA2] = {COMMAND_LONG_SIZE, command_self_test},              // vendor: self test
+    [0xA3] = {COMMAND_LONG_SIZE, command_segments},               // vendor: segments of a segmented capture
+    [0xA4] = {COMMAND_LONG_SIZE, command_segment_times},          // vendor: segment times
+    [0xA5] = {COMMAND_LONG_SIZE, command_counters},               // vendor: counters
+    [0xA6] = {COMMAND_LONG_SIZE, command_capture_status},         // vendor: capture status
+    [0xA7] = {COMMAND_LONG_SIZE, command_benchmark},              // vendor: rate benchmark
+    [0xA8] = {COMMAND_LONG_SIZE, command_decoder},                // vendor: decoder configuration
+    [0xA9] = {COMMAND_LONG_SIZE, command_decoder_baud_rate},      // vendor: decoder UART baud rate
+    [0xAA] = {COMMAND_LONG_SIZE, command_decode},                 // vendor: decode the last capture
+    [0xAB] = {COMMAND_LONG_SIZE, command_protocol_trigger},       // vendor: protocol trigger on the decoder bus
+    [0xC0] = {COMMAND_LONG_SIZE, command_trigger_mask},           // trigger mask stage 0
+    [0xC1] = {COMMAND_LONG_SIZE, command_trigger_values},         // trigger values stage 0
+    [0xC2] = {COMMAND_LONG_SIZE, command_trigger_configuration},  // trigger configuration stage 0
+    [0xC4] = {COMMAND_LONG_SIZE, command_trigger_mask},           // trigger mask stage 1
+    [0xC5] = {COMMAND_LONG_SIZE, command_trigger_values},         // trigger values stage 1
+    [0xC6] = {COMMAND_LONG_SIZE, command_trigger_configuration},  // trigger configuration stage 1
+    [0xC8] = {COMMAND_LONG_SIZE, command_trigger_mask},           // trigger mask stage 2
+    [0xC9] = {COMMAND_LONG_SIZE, command_trigger_values},         // trigger values stage 2
+    [0xCA] = {COMMAND_LONG_SIZE, command_trigger_configuration},  // trigger configuration stage 2
+    [0xCC] = {COMMAND_LONG_SIZE, command_trigger_mask},           // trigger mask stage 3
+    [0xCD] = {COMMAND_LONG_SIZE, command_trigger_values},         // trigger values stage 3
+    [0xCE] = {COMMAND_LONG_SIZE, command_trigger_configuration}   // trigger configuration stage 3
+};
+
+void sump_init(void) { stdio_set_chars_available_callback(command_receive, NULL); }
+
+bool sump_is_reset_received(void) { return is_reset_received_; }
 
 uint sump_read(void) {
-    int c = getchar_timeout_us(0);
-    if (c != PICO_ERROR_TIMEOUT) {
-        switch (c) {
-            case 0x00:  // reset
-                debug_block("\nReset (0x%X)", c);
-                return COMMAND_RESET;
-                break;
-            case 0x01:  // run
-                debug_block("\nRun (0x%X)...", c);
-                prepare_adquisition();
-                return COMMAND_CAPTURE;
-                break;
-            case 0x02:  // send id
-                printf("1ALS");
-                debug_block("\nSend ID (0x%X)", c);
-                break;
-            case 0x04:  // send metadata
-                // device name
-                putchar(0x01);
-                printf("%s", DEVICE_NAME);
-                putchar(0x00);
-                // firmware version
-                putchar(0x02);
-                printf("%s", DEVICE_VERSION);
-                putchar(0x00);
-                // sample memory
-                putchar(0x21);
-                put_uint32(MAX_TOTAL_SAMPLES);
-                // sample rate
-                putchar(0x23);
-                put_uint32(MAX_SAMPLE_RATE);
-                // number of channels
-                putchar(0x40);
-                putchar(capture_config_.channels);
-                // protocol version
-                putchar(0x41);
-                putchar(PROTOCOL_VERSION);
-                // eof
-                putchar(0x00);
-                debug_block(
-                    "\nSend metadata (0x%X):"
-                    "\n-Name: %s"
-                    "\n-Version: %s"
-                    "\n-Max samples: %u"
-                    "\n-Max rate: %u"
-                    "\n-Probes: %u"
-                    "\n-Protocol: %u",
-                    c, DEVICE_NAME, DEVICE_VERSION, MAX_TOTAL_SAMPLES, MAX_SAMPLE_RATE, capture_config_.channels,
-                    PROTOCOL_VERSION);
-                break;
-            // stage 0
-            case 0xC0:  // trigger mask stage 0
-                sump_trigger_[0].mask = get_uint32();
-                debug_block("\nRead trigger stage 0 mask (0x%X): %u", c, sump_trigger_[0].mask);
-                break;
-            case 0xC1:  // trigger values stage 0
-                sump_trigger_[0].values = get_uint32();
-                debug_block("\nRead trigger stage 0 values (0x%X): 0x%X", c, sump_trigger_[0].values);
-                break;
-            case 0xC2:  // trigger configuration stage 0
-                sump_trigger_[0].configuration = get_uint32();
-                debug_block("\nRead trigger stage 0 configuration (0x%X): 0x%X", c, sump_trigger_[0].configuration);
-                break;
-            // stage 1
-            case 0xC4:  // trigger mask stage 1
-                sump_trigger_[1].mask = get_uint32();
-                debug_block("\nRead trigger stage 1 mask (0x%X): %u", c, sump_trigger_[1].mask);
-                break;
-            case 0xC5:  // trigger values stage 1
-                sump_trigger_[1].values = get_uint32();
-                debug_block("\nRead trigger stage 1 values (0x%X): 0x%X", c, sump_trigger_[1].values);
-                break;
-            case 0xC6:  // trigger configuration stage 1
-                sump_trigger_[1].configuration = get_uint32();
-                debug_block("\nRead trigger stage 1 configuration (0x%X): 0x%X", c, sump_trigger_[1].configuration);
-                break;
-            // stage 2
-            case 0xC8:  // trigger mask stage 2
-                sump_trigger_[2].mask = get_uint32();
-                debug_block("\nRead trigger stage 2 mask (0x%X): %u", c, sump_trigger_[2].mask);
-                break;
-            case 0xC9:  // trigger values stage 2
-                sump_trigger_[2].values = get_uint32();
-                debug_block("\nRead trigger stage 2 values (0x%X): 0x%X", c, sump_trigger_[2].values);
-                break;
-            case 0xCA:  // trigger configuration stage 2
-                sump_trigger_[2].configuration = get_uint32();
-                debug_block("\nRead trigger stage 2 configuration (0x%X): 0x%X", c, sump_trigger_[2].configuration);
-                break;
-            // stage 3
-            case 0xCC:  // trigger mask stage 3
-                sump_trigger_[3].mask = get_uint32();
-                debug_block("\nRead trigger stage 3 mask (0x%X): %u", c, sump_trigger_[3].mask);
-                break;
-            case 0xCD:  // trigger values stage 3
-                sump_trigger_[3].values = get_uint32();
-                debug_block("\nRead trigger stage 3 values (0x%X): 0x%X", c, sump_trigger_[3].values);
-                break;
-            case 0xCE:  // trigger configuration stage 3
-                sump_trigger_[3].configuration = get_uint32();
-                debug_block("\nRead trigger stage 3 configuration (0x%X): 0x%X", c, sump_trigger_[3].configuration);
-                break;
-            case 0x80:  // divisor
-                divisor_ = get_uint32();
-                debug_block("\nRead divisor (0x%X): %u", c, divisor_);
-                break;
-            case 0x81:  // sample size & pre trigger size
-            {
-                uint32_t value = get_uint32();
-                capture_config_.total_samples = ((uint16_t)value * 4 + 4);
-                capture_config_.pre_trigger_samples = capture_config_.total_samples - (((value >> 16) * 4) + 4);
-                debug_block("\nRead samples (0x%X): %u", c, capture_config_.total_samples);
-                debug_block("\nRead pre trigger samples (0x%X): %u", c, capture_config_.pre_trigger_samples);
-                break;
-            }
-            case 0x82:  // flags. samplerate <= clock rate: demux off. samplerate > clock rate: demux on
-                flags_ = get_uint32();
-                if (flags_ & FLAG_DEMUX_MODE)
-                    capture_config_.rate = 2 * CLOCK_RATE / (divisor_ + 1);
-                else
-                    capture_config_.rate = CLOCK_RATE / (divisor_ + 1);
-                debug_block(
-                    "\nRead flags (0x%X): 0x%X"
-                    "\n-Demux: %s -> Rate: %u"
-                    "\n-RLE: %s"
-                    "\n-Channel group 1: %s"
-                    "\n-Channel group 2: %s"
-                    "\n-Channel group 3: %s"
-                    "\n-Channel group 4: %s",
-                    c, flags_, flags_ & FLAG_DEMUX_MODE ? "enabled" : "disabled", capture_config_.rate,
-                    flags_ & FLAG_RLE ? "enabled" : "disabled",
-                    flags_ & FLAG_DISABLE_CHANGROUP_1 ? "disabled" : "enabled",
-                    flags_ & FLAG_DISABLE_CHANGROUP_2 ? "disabled" : "enabled",
-                    flags_ & FLAG_DISABLE_CHANGROUP_3 ? "disabled" : "enabled",
-                    flags_ & FLAG_DISABLE_CHANGROUP_4 ? "disabled" : "enabled");
-                break;
-            case 0x83:  // sample size
-                capture_config_.total_samples = get_uint32();
-                debug_block("\nRead samples (0x%X): %u", c, capture_config_.total_samples);
-                break;
-            case 0x84:  // pre trigger size
-            {
-                uint32_t value = get_uint32();
-                capture_config_.pre_trigger_samples = capture_config_.total_samples - ((uint16_t)value * 4 + 4);
-                debug_block("\nRead pre trigger samples (0x%X): %u", c, capture_config_.pre_trigger_samples);
-                break;
-            }
-            default:
-                debug_block("\nUnknown command: 0x%X", c);
-                break;
-        }
+    // Dispatch a whole command with the command table. The value of long commands is read before the handler
+    int c = command_get();
+    if (c < 0) return COMMAND_NONE;
+    counters_.commands++;
+    uint32_t value = get_command_size(c) == COMMAND_LONG_SIZE ? get_uint32() : 0;
+    if (!command_table_[c].handler) {
+        debug_block("\nUnknown command: 0x%X", c);
+        return COMMAND_NONE;
     }
+    return command_table_[c].handler(c, value);
+}
+
+static uint command_reset(uint8_t command, uint32_t value) {
+    // Back to the SUMP upload
+    (void)value;
+    frame_set_enabled(false);
+    debug_block("\nReset (0x%X)", command);
+    return COMMAND_RESET;
+}
+
+static uint command_run(uint8_t command, uint32_t value) {
+    (void)value;
+    debug_block("\nRun (0x%X)...", command);
+    prepare_adquisition();
+    prepare_mode();
+    return COMMAND_CAPTURE;
+}
+
+static uint command_id(uint8_t command, uint32_t value) {
+    (void)value;
+    printf("1ALS");
+    debug_block("\nSend ID (0x%X)", command);
+    return COMMAND_NONE;
+}
+
+static uint command_frame_handshake(uint8_t command, uint32_t value) {
+    (void)value;
+    frame_set_enabled(true);
+    printf(FRAME_MAGIC);
+    debug_block("\nFramed upload (0x%X)", command);
+    return COMMAND_NONE;
+}
+
+static uint command_metadata(uint8_t command, uint32_t value) {
+    (void)value;
+    // sample memory depends on the enabled channels
+    uint max_samples = get_max_samples(get_channel_mask(), mode_);
+    // max rate measured by the benchmark, if it was run
+    uint max_rate = get_max_rate(get_channel_mask());
+    if (!max_rate || max_rate > MAX_SAMPLE_RATE) max_rate = MAX_SAMPLE_RATE;
+    // device name
+    putchar(0x01);
+    printf("%s", DEVICE_NAME);
+    putchar(0x00);
+    // firmware version
+    putchar(0x02);
+    printf("%s", DEVICE_VERSION);
+    putchar(0x00);
+    // sample memory
+    putchar(0x21);
+    put_uint32(max_samples * get_bytes_per_sample());
+    // sample rate
+    putchar(0x23);
+    put_uint32(max_rate);
+    // number of channels
+    putchar(0x40);
+    putchar(capture_config_.channels);
+    // protocol version
+    putchar(0x41);
+    putchar(PROTOCOL_VERSION);
+    // eof
+    putchar(0x00);
+    debug_block(
+        "\nSend metadata (0x%X):"
+        "\n-Name: %s"
+        "\n-Version: %s"
+        "\n-Max samples: %u (channels 0x%04X)"
+        "\n-Max rate: %u"
+        "\n-Probes: %u"
+        "\n-Protocol: %u",
+        command, DEVICE_NAME, DEVICE_VERSION, max_samples, get_channel_mask(), max_rate, capture_config_.channels,
+        PROTOCOL_VERSION);
+    return COMMAND_NONE;
+}
+
+static uint command_trigger_mask(uint8_t command, uint32_t value) {
+    // Stage in bits 2-3 of the command
+    uint stage = (command >> 2) & 3;
+    sump_trigger_[stage].mask = value;
+    debug_block("\nRead trigger stage %u mask (0x%X): %u", stage, command, value);
+    return COMMAND_NONE;
+}
+
+static uint command_trigger_values(uint8_t command, uint32_t value) {
+    uint stage = (command >> 2) & 3;
+    sump_trigger_[stage].values = value;
+    debug_block("\nRead trigger stage %u values (0x%X): 0x%X", stage, command, value);
+    return COMMAND_NONE;
+}
+
+static uint command_trigger_configuration(uint8_t command, uint32_t value) {
+    uint stage = (command >> 2) & 3;
+    sump_trigger_[stage].configuration = value;
+    debug_block("\nRead trigger stage %u configuration (0x%X): 0x%X", stage, command, value);
+    return COMMAND_NONE;
+}
+
+static uint command_divisor(uint8_t command, uint32_t value) {
+    divisor_ = value;
+    debug_block("\nRead divisor (0x%X): %u", command, divisor_);
+    return COMMAND_NONE;
+}
+
+static uint command_sizes(uint8_t command, uint32_t value) {
+    // Sample size and pre trigger size
+    capture_config_.total_samples = ((uint16_t)value * 4 + 4);
+    capture_config_.pre_trigger_samples = capture_config_.total_samples - (((value >> 16) * 4) + 4);
+    debug_block("\nRead samples (0x%X): %u", command, capture_config_.total_samples);
+    debug_block("\nRead pre trigger samples (0x%X): %u", command, capture_config_.pre_trigger_samples);
+    return COMMAND_NONE;
+}
+
+static uint command_flags(uint8_t command, uint32_t value) {
+    // samplerate <= clock rate: demux off. samplerate > clock rate: demux on. One capture state machine samples up to
+    // 200 MHz, so demux only doubles the rate
+    flags_ = value;
+    if (flags_ & FLAG_DEMUX_MODE)
+        capture_config_.rate = 2 * CLOCK_RATE / (divisor_ + 1);
+    else
+        capture_config_.rate = CLOCK_RATE / (divisor_ + 1);
+    debug_block(
+        "\nRead flags (0x%X): 0x%X"
+        "\n-Demux: %s -> Rate: %u"
+        "\n-RLE: %s"
+        "\n-External clock: %s%s"
+        "\n-Channel group 1: %s"
+        "\n-Channel group 2: %s"
+        "\n-Channel group 3: %s"
+        "\n-Channel group 4: %s",
+        command, flags_, flags_ & FLAG_DEMUX_MODE ? "enabled" : "disabled", capture_config_.rate,
+        flags_ & FLAG_RLE ? "enabled" : "disabled", flags_ & FLAG_CLOCK_EXTERNAL ? "enabled" : "disabled",
+        flags_ & FLAG_INVERT_EXT_CLOCK ? " (inverted)" : "", flags_ & FLAG_DISABLE_CHANGROUP_1 ? "disabled" : "enabled",
+        flags_ & FLAG_DISABLE_CHANGROUP_2 ? "disabled" : "enabled",
+        flags_ & FLAG_DISABLE_CHANGROUP_3 ? "disabled" : "enabled",
+        flags_ & FLAG_DISABLE_CHANGROUP_4 ? "disabled" : "enabled");
+    return COMMAND_NONE;
+}
+
+static uint command_sample_size(uint8_t command, uint32_t value) {
+    capture_config_.total_samples = value;
+    debug_block("\nRead samples (0x%X): %u", command, capture_config_.total_samples);
+    return COMMAND_NONE;
+}
+
+static uint command_pre_trigger_size(uint8_t command, uint32_t value) {
+    capture_config_.pre_trigger_samples = capture_config_.total_samples - ((uint16_t)value * 4 + 4);
+    debug_block("\nRead pre trigger samples (0x%X): %u", command, capture_config_.pre_trigger_samples);
+    return COMMAND_NONE;
+}
+
+static uint command_capture_mode(uint8_t command, uint32_t value) {
+    mode_ = value;
+    if (mode_ > CAPTURE_MODE_TRANSITION) mode_ = CAPTURE_MODE_ONE_SHOT;
+    debug_block("\nRead capture mode (0x%X): %u", command, mode_);
+    return COMMAND_NONE;
+}
+
+static uint command_channel_mask(uint8_t command, uint32_t value) {
+    channel_mask_ = value;
+    debug_block("\nRead channel mask (0x%X): 0x%08X", command, channel_mask_);
+    return COMMAND_NONE;
+}
+
+static uint command_self_test(uint8_t command, uint32_t value) {
+    // Reply the mask of the rates passed
+    (void)value;
+    debug_block("\nSelf test (0x%X)", command);
+    put_uint32(capture_self_test());
+    return COMMAND_NONE;
+}
+
+static uint command_segments(uint8_t command, uint32_t value) {
+    segments_ = value;
+    if (segments_ < 1) segments_ = 1;
+    if (segments_ > CAPTURE_SEGMENTS_MAX) segments_ = CAPTURE_SEGMENTS_MAX;
+    debug_block("\nRead segments (0x%X): %u", command, segments_);
+    return COMMAND_NONE;
+}
+
+static uint command_segment_times(uint8_t command, uint32_t value) {
+    // Reply the segments count and the trigger time of each segment
+    (void)value;
+    uint count = get_segments_count();
+    debug_block("\nSegment times (0x%X): %u", command, count);
+    put_uint32(count);
+    for (uint i = 0; i < count; i++) put_uint32(get_segment_time(i));
+    return COMMAND_NONE;
+}
+
+static uint command_counters(uint8_t command, uint32_t value) {
+    // Reply the counters count and the counters
+    (void)value;
+    const uint *counters = (const uint *)&counters_;
+    uint count = sizeof(counters_) / sizeof(uint);
+    debug_block("\nCounters (0x%X): %u", command, count);
+    put_uint32(count);
+    for (uint i = 0; i < count; i++) put_uint32(counters[i]);
+    return COMMAND_NONE;
+}
+
+static uint command_capture_status(uint8_t command, uint32_t value) {
+    // Reply the status flags of the last capture
+    (void)value;
+    debug_block("\nCapture status (0x%X): 0x%02X", command, get_capture_status());
+    put_uint32(get_capture_status());
+    return COMMAND_NONE;
+}
+
+static uint command_benchmark(uint8_t command, uint32_t value) {
+    // Reply the max rate without stalls for the 6 widths, 1 to 32 bit, then the max RLE rate for the 6 widths
+    (void)value;
+    uint max_rates[CAPTURE_WIDTHS_COUNT], rle_max_rates[CAPTURE_WIDTHS_COUNT];
+    debug_block("\nRate benchmark (0x%X)", command);
+    uint count = capture_benchmark(max_rates, rle_max_rates);
+    put_uint32(count);
+    for (uint i = 0; i < count; i++) put_uint32(max_rates[i]);
+    for (uint i = 0; i < count; i++) put_uint32(rle_max_rates[i]);
+    return COMMAND_NONE;
+}
+
+static uint command_decoder(uint8_t command, uint32_t value) {
+    decoder_set_config(value);
+    debug_block("\nRead decoder (0x%X): %u", command, decoder_get_protocol());
+    return COMMAND_NONE;
+}
+
+static uint command_decoder_baud_rate(uint8_t command, uint32_t value) {
+    decoder_set_baud_rate(value);
+    debug_block("\nRead decoder baud rate (0x%X): %u", command, value);
+    return COMMAND_NONE;
+}
+
+static uint command_decode(uint8_t command, uint32_t value) {
+    // Reply the decoded records and the end record
+    (void)value;
+    debug_block("\nDecode (0x%X)", command);
+    send_decoded();
+    return COMMAND_NONE;
+}
+
+static uint command_protocol_trigger(uint8_t command, uint32_t value) {
+    protocol_trigger_ = value;
+    debug_block("\nRead protocol trigger (0x%X): 0x%X", command, protocol_trigger_);
     return COMMAND_NONE;
 }
 
 void sump_send_samples(void) {
+    /*
+     * Core1 encodes the samples (RLE, channel groups) into the upload queue while core0 sends the queued blocks and
+     * reads the commands, so the upload is limited by the USB link and not by the encoding
+     */
+
+    capture_prepare_read();
+    if (frame_is_enabled()) {
+        frame_send_samples();
+        set_upload_byte_rate();
+        return;
+    }
+
     debug("\nSend samples. RLE %s", flags_ & FLAG_RLE ? "enabled" : "disabled");
-    int min_index = get_samples_count() - capture_config_.total_samples;
+    uint64_t start_time = time_us_64();
+    if (!upload_run(upload_encoder)) {
+        debug("\nCapture aborted");
+        return;
+    }
+
+    uint64_t elapsed = time_us_64() - start_time;
+    counters_.upload_bytes = send_bytes_;
+    counters_.upload_time = elapsed;
+    set_upload_byte_rate();
+    debug("\nTransfer completed. Bytes: %u Time: %u us Rate: %u bytes/s", send_bytes_, (uint)elapsed,
+          elapsed ? (uint)((uint64_t)send_bytes_ * 1000000 / elapsed) : 0);
+}
+
+static bool upload_run(void (*encoder)(void)) {
+    // Run the encoder on core1 and send the queued blocks until it is done. False if aborted by a reset
+    send_bytes_ = 0;
+    upload_head_ = 0;
+    upload_tail_ = 0;
+    upload_is_done_ = false;
+    upload_is_aborted_ = false;
+    is_upload_queued_ = true;
+    send_buffer_ = upload_queue_[0].data;
+    send_buffer_count_ = 0;
+    multicore_reset_core1();
+    multicore_launch_core1(encoder);
+
+    while (true) {
+        if (is_reset_received_) {
+            upload_is_aborted_ = true;
+            break;
+        }
+        if (upload_tail_ != upload_head_) {
+            upload_block_t *block = &upload_queue_[upload_tail_ & (UPLOAD_QUEUE_SIZE - 1)];
+            stdio_usb.out_chars((const char *)block->data, block->count);
+            send_bytes_ += block->count;
+            __dmb();
+            upload_tail_++;
+        } else if (upload_is_done_ && upload_tail_ == upload_head_) {
+            break;
+        } else {
+            debug_task();
+            tight_loop_contents();
+        }
+    }
+    multicore_reset_core1();
+    is_upload_queued_ = false;
+    send_buffer_ = send_buffer_direct_;
+    send_buffer_count_ = 0;
+    return !upload_is_aborted_;
+}
 
-    if ((flags_ & FLAG_RLE)) {
-        uint channelgroup_mask = 0;
-        if ((flags_ & FLAG_DISABLE_CHANGROUP_1) == 0) channelgroup_mask = 0xff;
-        if ((flags_ & FLAG_DISABLE_CHANGROUP_2) == 0) channelgroup_mask |= 0xff << 8;
+static void upload_encoder(void) {
+    /*
+     * Core1. Encode the samples, newest first, into the upload queue. Transition captures are expanded a transition at
+     * a time. Captures stored as spans of packed samples are read a word at a time. Otherwise (RLE captures) the
+     * samples are read one by one
+     */
+
+    int min_index = get_samples_count() - capture_config_.total_samples;
+    uint skip = min_index > 0 ? min_index : 0, padding = min_index < 0 ? -min_index : 0;
+    uint channelgroup_mask = get_channelgroup_mask();
+    // The run count has the size of a sample, with the most significant bit set
+    uint rle_max_count = 1u << (8 * get_bytes_per_sample() - 1);
+    capture_span_t spans[CAPTURE_SPANS_MAX];
+    uint spans_count = get_capture_spans(spans);
+    uint transitions_count = get_transitions_count();
 
+    if (transitions_count) {
+        send_transitions(transitions_count, skip, padding, channelgroup_mask, rle_max_count);
+    } else if (spans_count) {
+        if (flags_ & FLAG_RLE)
+            send_spans_rle(spans, spans_count, skip, padding, channelgroup_mask, rle_max_count);
+        else
+            send_spans(spans, spans_count, skip, padding);
+    } else if ((flags_ & FLAG_RLE)) {
         int samples_count = get_samples_count();
         int index = samples_count - 1;
         uint sample = get_sample_index(index) & channelgroup_mask;
         uint sample_prev = sample;
-        uint rle_max_count = (flags_ & FLAG_DISABLE_CHANGROUP_1) || (flags_ & FLAG_DISABLE_CHANGROUP_2)
-                                 ? (0xff >> 1) + 1
-                                 : (0xffff >> 1) + 1;
-
-        while (index > min_index) {
-            if (sump_read() == COMMAND_RESET) {
-                debug("\nCapture aborted");
-                return;
-            }
 
+        while (index >= min_index && !upload_is_aborted_) {
             uint rle_count = 0;
             do {
                 index--;
@@ -266,17 +592,215 @@ void sump_send_samples(void) {
             send_sample_rle(sample_prev, rle_count);
         }
     } else {
-        for (int i = get_samples_count() - 1; i >= min_index; i--) {
-            if (sump_read() == COMMAND_RESET) {
-                debug("\nCapture aborted");
-                return;
-            }
+        for (int i = get_samples_count() - 1; i >= min_index && !upload_is_aborted_; i--) {
             uint sample = get_sample_index(i);
             send_sample(sample);
-            debug("\nSample %i: 0x%04X", i - min_index, sample);
+            debug_verbose("\nSample %i: 0x%04X", i - min_index, sample);
+        }
+    }
+    send_flush();
+    upload_is_done_ = true;
+}
+
+static void upload_decoder(void) {
+    // Core1. Decode the capture into the upload queue, oldest record first, and add the end record
+    decoder_records_ = decoder_run(send_record);
+    decoder_record_t end = {.sample = decoder_records_, .data = 0, .flags = DECODER_FLAG_END};
+    send_record(&end);
+    send_flush();
+    upload_is_done_ = true;
+}
+
+static void send_record(const decoder_record_t *record) {
+    if (upload_is_aborted_) return;
+    send_byte(record->sample);
+    send_byte(record->sample >> 8);
+    send_byte(record->sample >> 16);
+    send_byte(record->sample >> 24);
+    send_byte(record->data);
+    send_byte(record->flags);
+}
+
+static inline void send_decoded(void) {
+    // Decoders read the stored samples: nothing is decoded while capturing
+    uint64_t start_time = time_us_64();
+    if (capture_is_busy()) {
+        put_uint32(0);
+        putchar(0);
+        putchar(DECODER_FLAG_END);
+        debug("\nDecode rejected. Capture running");
+        return;
+    }
+    capture_prepare_read();
+    if (!upload_run(upload_decoder)) {
+        debug("\nDecode aborted");
+        return;
+    }
+    uint64_t elapsed = time_us_64() - start_time;
+    counters_.upload_bytes = send_bytes_;
+    counters_.upload_time = elapsed;
+    debug("\nDecode completed. Records: %u Bytes: %u Time: %u us", decoder_records_, send_bytes_, (uint)elapsed);
+}
+
+static inline void send_spans(const capture_span_t *spans, uint spans_count, uint skip, uint padding) {
+    // Newest sample first. Skip the oldest samples not requested and pad with 0x0000 samples the missing ones
+    for (uint i = spans_count; i-- > 0 && !upload_is_aborted_;) {
+        const capture_span_t *span = &spans[i];
+        uint bits = 5 - __builtin_ctz(span->width), mask = 0xffffffffu >> (32 - span->width);
+        uint index = span->first + span->count, end = span->first;
+        if (skip) {
+            uint count = skip < span->count ? skip : span->count;
+            end += count;
+            skip -= count;
+        }
+        while (index > end && !upload_is_aborted_) {
+            index--;
+            uint shift = (index & ((1u << bits) - 1)) * span->width;
+            send_sample(((span->buffer[index >> bits] >> shift) & mask) << span->base);
         }
     }
-    debug("\nTransfer completed");
+    while (padding-- && !upload_is_aborted_) send_sample(0);
+}
+
+static inline void send_spans_rle(const capture_span_t *spans, uint spans_count, uint skip, uint padding,
+                                  uint channelgroup_mask, uint rle_max_count) {
+    /*
+     * Newest sample first. Words with all the samples equal to the current run are counted at once: two 16 bit
+     * samples per compare, four 8 bit samples and so on. Runs longer than the SUMP max count are split
+     */
+
+    uint value = 0, count = 0;
+    for (uint i = spans_count; i-- > 0 && !upload_is_aborted_;) {
+        const capture_span_t *span = &spans[i];
+        uint bits = 5 - __builtin_ctz(span->width), samples_per_word = 1u << bits;
+        uint sample_mask = 0xffffffffu >> (32 - span->width), replicate = 0xffffffffu / sample_mask;
+        uint mask = (channelgroup_mask >> span->base) & sample_mask;
+        uint32_t word_mask = mask * replicate, value_word = (value >> span->base) * replicate;
+        uint index = span->first + span->count, end = span->first;
+        if (skip) {
+            uint skipped = skip < span->count ? skip : span->count;
+            end += skipped;
+            skip -= skipped;
+        }
+        while (index > end && !upload_is_aborted_) {
+            if (!(index & (samples_per_word - 1)) && index - end >= samples_per_word && count &&
+                (span->buffer[(index >> bits) - 1] & word_mask) == value_word) {
+                index -= samples_per_word;
+                count += samples_per_word;
+                continue;
+            }
+            index--;
+            uint sample = ((span->buffer[index >> bits] >> ((index & (samples_per_word - 1)) * span->width)) & mask)
+                          << span->base;
+            if (sample == value && count) {
+                count++;
+                continue;
+            }
+            send_run(value, count, rle_max_count);
+            value = sample;
+            value_word = (value >> span->base) * replicate;
+            count = 1;
+        }
+    }
+    if (padding) {
+        if (value || !count) {
+            send_run(value, count, rle_max_count);
+            value = 0;
+            count = 0;
+        }
+        count += padding;
+    }
+    if (!upload_is_aborted_) send_run(value, count, rle_max_count);
+}
+
+static inline void send_run(uint sample, uint count, uint rle_max_count) {
+    while (count > rle_max_count) {
+        send_sample_rle(sample, rle_max_count);
+        count -= rle_max_count;
+    }
+    if (count) send_sample_rle(sample, count);
+}
+
+static inline void send_transitions(uint transitions_count, uint skip, uint padding, uint channelgroup_mask,
+                                    uint rle_max_count) {
+    /*
+     * Newest sample first. Each transition is a run of samples up to the next transition, or up to the last sample.
+     * Transitions of the channels not sent are merged with the run
+     */
+
+    uint end = get_samples_count(), value = 0, count = 0;
+    capture_transition_t transition;
+    for (uint i = transitions_count; i-- > 0 && end > skip && !upload_is_aborted_;) {
+        if (!get_transition(i, &transition) || transition.sample >= end) continue;
+        uint first = transition.sample > skip ? transition.sample : skip;
+        uint sample = transition.value & channelgroup_mask;
+        if (sample != value && count) {
+            send_transition_run(value, count, rle_max_count);
+            count = 0;
+        }
+        value = sample;
+        count += end - first;
+        end = first;
+    }
+    if (padding) {
+        if (value && count) {
+            send_transition_run(value, count, rle_max_count);
+            count = 0;
+        }
+        value = 0;
+        count += padding;
+    }
+    if (!upload_is_aborted_) send_transition_run(value, count, rle_max_count);
+}
+
+static inline void send_transition_run(uint sample, uint count, uint rle_max_count) {
+    if (flags_ & FLAG_RLE) {
+        send_run(sample, count, rle_max_count);
+        return;
+    }
+    while (count-- && !upload_is_aborted_) send_sample(sample);
+}
+
+void sump_send_stream(void) {
+    debug("\nSend stream");
+    uint remaining = capture_config_.total_samples;
+    uint64_t start_time = time_us_64();
+    send_buffer_count_ = 0;
+    send_bytes_ = 0;
+
+    while (remaining) {
+        if (is_reset_received_) {
+            capture_abort();
+            send_buffer_count_ = 0;
+            debug("\nStream aborted");
+            return;
+        }
+        const uint16_t *samples;
+        uint count = capture_stream_get_block(&samples);
+        if (!count) {
+            if (!capture_is_busy()) break;
+            debug_task();
+            tight_loop_contents();
+            continue;
+        }
+        if (count > remaining) count = remaining;
+        for (uint i = 0; i < count; i++) send_sample(samples[i]);
+        send_flush();
+        capture_stream_release_block();
+        remaining -= count;
+    }
+
+    // Overrun. Complete the transfer so the host is not left waiting
+    if (remaining) {
+        debug("\nStream overrun. Missing samples (%u) sent as 0x0000 samples", remaining);
+        while (remaining--) send_sample(0);
+    }
+    send_flush();
+    uint64_t elapsed = time_us_64() - start_time;
+    counters_.upload_bytes = send_bytes_;
+    counters_.upload_time = elapsed;
+    debug("\nStream completed. Bytes: %u Time: %u us Rate: %u bytes/s", send_bytes_, (uint)elapsed,
+          elapsed ? (uint)((uint64_t)send_bytes_ * 1000000 / elapsed) : 0);
 }
 
 void sump_reset(void) {
@@ -285,13 +809,15 @@ void sump_reset(void) {
         sump_trigger_[i].values = 0;
         sump_trigger_[i].configuration = 0;
     }
+    protocol_trigger_ = 0;
 }
 
 static inline void prepare_adquisition(void) {
     /*
-     * All stages must be level 0 (immediate) and armed
-     * Level triggers (1 stage for all level triggers): parallel. Note: also serial size 1, which uses 1 stage for each
-     * Edge triggers (serial, size 2)
+     * All stages must be level 0 (immediate) and armed. Each stage is a trigger, matched against all the channels in
+     * the mask at once. Triggers of different stages are ORed
+     * Parallel stages: channels in mask equal to values. With trigger edge override, when they change to values
+     * Serial stages, one channel: mask 0b1 (level) or mask 0b11 and values 0b10/0b01 (rising/falling edge)
      */
 
     for (uint i = 0; i < TRIGGERS_COUNT; i++) {
@@ -303,103 +829,248 @@ static inline void prepare_adquisition(void) {
         debug_block("\nStage: %u Mask: 0x%00000000X Values: 0x%00000000X Configuration: 0x%00000000X", stage,
                     sump_trigger_[stage].mask, sump_trigger_[stage].values, sump_trigger_[stage].configuration);
 
-        if (sump_trigger_[stage].mask &&
-            ((sump_trigger_[stage].configuration & TRIGGER_START) &&
-             ((sump_trigger_[stage].configuration & TRIGGER_LEVEL_MASK) == 0))) {
-            // level triggers (parallel trigger)
-            if (!(sump_trigger_[stage].configuration & TRIGGER_SERIAL)) {
-                for (uint channel = 0; channel < config_.channels; channel++) {
-                    if (((sump_trigger_[stage].mask >> channel) & 1) != 0) {
-                        capture_config_.trigger[trigger_count].is_enabled = true;
-                        capture_config_.trigger[trigger_count].pin = channel;
-
-                        if (!config_.trigger_edge) {
-                            if (((sump_trigger_[stage].values >> channel) & 1) == 1)
-                                capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_LEVEL_HIGH;
-                            else
-                                capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_LEVEL_LOW;
-                        } else {
-                            if (((sump_trigger_[stage].values >> channel) & 1) == 1)
-                                capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_EDGE_HIGH;
-                            else
-                                capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_EDGE_LOW;
-                        }
-
-                        trigger_count++;
-                        if (trigger_count > 3) {
-                            debug("\nTrigger ignored. Reached maximum number of triggers (%u)", TRIGGERS_COUNT);
-                            return;
-                        }
-                    }
-                }
-            }
-            // edge triggers (serial, mask 0b11)
-            else if ((sump_trigger_[stage].configuration & TRIGGER_SERIAL) && (sump_trigger_[stage].mask == 0b11)) {
-                capture_config_.trigger[trigger_count].is_enabled = true;
-                capture_config_.trigger[trigger_count].pin =
-                    (sump_trigger_[stage].configuration & TRIGGER_CHANNEL_MASK) >> 20;
-
-                if (((sump_trigger_[stage].values & 1) == 0) && (((sump_trigger_[stage].values >> 1) & 1) == 1)) {
-                    capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_EDGE_HIGH;
-                    trigger_count++;
-                } else if (((sump_trigger_[stage].values & 1) == 1) &&
-                           (((sump_trigger_[stage].values >> 1) & 1) == 0)) {
-                    capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_EDGE_LOW;
-                    trigger_count++;
-                } else {
-                    capture_config_.trigger[trigger_count].is_enabled = false;
-                }
-            } else if ((sump_trigger_[stage].configuration & TRIGGER_SERIAL) && (sump_trigger_[stage].mask == 0b1)) {
-                capture_config_.trigger[trigger_count].is_enabled = true;
-                capture_config_.trigger[trigger_count].pin =
-                    (sump_trigger_[stage].configuration & TRIGGER_CHANNEL_MASK) >> 20;
-
-                if ((sump_trigger_[stage].values & 1) == 1) {
-                    capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_LEVEL_HIGH;
-                    trigger_count++;
-                } else {
-                    capture_config_.trigger[trigger_count].match = TRIGGER_TYPE_LEVEL_LOW;
-                    trigger_count++;
-                }
-            }
+        if (!sump_trigger_[stage].mask || !(sump_trigger_[stage].configuration & TRIGGER_START) ||
+            (sump_trigger_[stage].configuration & TRIGGER_LEVEL_MASK))
+            continue;
 
-            if (trigger_count > TRIGGERS_COUNT - 1) {
-                debug("\nTrigger ignored. Reached maximum number of triggers (%u)", TRIGGERS_COUNT);
-                return;
+        trigger_t *trigger = &capture_config_.trigger[trigger_count];
+        if (!(sump_trigger_[stage].configuration & TRIGGER_SERIAL)) {
+            // parallel: channels pattern
+            trigger->mask = sump_trigger_[stage].mask & ((1u << config_.channels) - 1);
+            trigger->value = sump_trigger_[stage].values & trigger->mask;
+            trigger->match = config_.trigger_edge ? TRIGGER_MATCH_EDGE : TRIGGER_MATCH_LEVEL;
+        } else {
+            // serial: single channel
+            uint channel = (sump_trigger_[stage].configuration & TRIGGER_CHANNEL_MASK) >> 20;
+            uint values = sump_trigger_[stage].values;
+            trigger->mask = 1u << channel;
+            if (sump_trigger_[stage].mask == 0b11 && (values & 0b11) == 0b10) {
+                trigger->value = 1u << channel;
+                trigger->match = TRIGGER_MATCH_EDGE;
+            } else if (sump_trigger_[stage].mask == 0b11 && (values & 0b11) == 0b01) {
+                trigger->value = 0;
+                trigger->match = TRIGGER_MATCH_EDGE;
+            } else if (sump_trigger_[stage].mask == 0b1) {
+                trigger->value = (values & 1) << channel;
+                trigger->match = TRIGGER_MATCH_LEVEL;
+            } else {
+                continue;
             }
         }
+        if (!trigger->mask) continue;
+        trigger->is_enabled = true;
+        trigger_count++;
     }
 
-    if (trigger_count < TRIGGERS_COUNT) {
-        capture_config_.trigger[trigger_count].is_enabled = false;
+    // Protocol trigger: a byte (I2C: an address) on the decoder bus, after the stage triggers
+    decoder_protocol_t protocol = decoder_get_protocol();
+    if (!(protocol_trigger_ & PROTOCOL_TRIGGER_ENABLE) || !protocol || trigger_count >= TRIGGERS_COUNT) return;
+    static const uint decoder_channel[TRIGGER_CHANNELS_COUNT] = {0, 1, 3};  // clock, data and chip select
+    uint channels_count = protocol == DECODER_PROTOCOL_UART  ? 1
+                          : protocol == DECODER_PROTOCOL_I2C ? 2
+                                                             : TRIGGER_CHANNELS_COUNT;
+    trigger_t *trigger = &capture_config_.trigger[trigger_count];
+    trigger->match = TRIGGER_MATCH_UART + protocol - DECODER_PROTOCOL_UART;
+    trigger->value = protocol_trigger_ & PROTOCOL_TRIGGER_VALUE_MASK;
+    trigger->mask = 0;
+    for (uint i = 0; i < TRIGGER_CHANNELS_COUNT; i++) {
+        uint channel = i < channels_count ? decoder_get_channel(decoder_channel[i]) : DECODER_CHANNEL_NONE;
+        trigger->channel[i] = channel == DECODER_CHANNEL_NONE ? TRIGGER_CHANNEL_NONE : channel;
+        if (channel != DECODER_CHANNEL_NONE) trigger->mask |= 1u << channel;
     }
+    trigger->baud_rate = decoder_get_baud_rate();
+    trigger->spi_mode = decoder_get_spi_mode();
+    // The clock and data channels are needed
+    if (trigger->channel[0] == TRIGGER_CHANNEL_NONE ||
+        (protocol != DECODER_PROTOCOL_UART && trigger->channel[1] == TRIGGER_CHANNEL_NONE))
+        return;
+    trigger->is_enabled = true;
+    debug_block("\nProtocol trigger. Protocol: %u Value: 0x%02X Channels: 0x%X", protocol, trigger->value,
+                trigger->mask);
+}
+
+static inline void prepare_mode(void) {
+    /*
+     * Rate governor: a stream must be sent as fast as it is captured, and RLE captures must be encoded as fast as they
+     * are captured. Captures above the sustained rate are rejected, flagged in the capture status and run as one shot
+     * captures (raw storage). The stream rate is limited by the measured upload rate, once an upload has measured it
+     */
+
+    capture_config_.mode = mode_;
+    capture_config_.channel_mask = get_channel_mask();
+    capture_config_.is_mode_rejected = false;
+    if (mode_ == CAPTURE_MODE_STREAM) {
+        uint max_rate = (upload_byte_rate_ ? upload_byte_rate_ : STREAM_MAX_BYTE_RATE) / get_bytes_per_sample();
+        if (capture_config_.rate > max_rate) {
+            capture_config_.mode = CAPTURE_MODE_ONE_SHOT;
+            capture_config_.is_mode_rejected = true;
+            debug_block("\nStream rejected. Rate %u exceeds max stream rate %u. Running one shot capture",
+                        capture_config_.rate, max_rate);
+        } else {
+            debug_block("\nStream. Rate: %u Max stream rate: %u", capture_config_.rate, max_rate);
+        }
+    } else if (mode_ == CAPTURE_MODE_RLE) {
+        uint max_rate = get_rle_max_rate(capture_config_.channel_mask);
+        if (capture_config_.rate > max_rate) {
+            capture_config_.mode = CAPTURE_MODE_ONE_SHOT;
+            capture_config_.is_mode_rejected = true;
+            debug_block("\nRLE rejected. Rate %u exceeds max RLE rate %u. Running one shot capture",
+                        capture_config_.rate, max_rate);
+        } else {
+            debug_block("\nRLE. Rate: %u Max RLE rate: %u", capture_config_.rate, max_rate);
+        }
+    }
+
+    // External clock: one sample per clock edge, the rate is set by the clock
+    capture_config_.clock_external = flags_ & FLAG_CLOCK_EXTERNAL;
+    capture_config_.clock_invert = flags_ & FLAG_INVERT_EXT_CLOCK;
+
+    // Segmented: raw samples, one segment per trigger
+    capture_config_.segments = segments_;
+}
+
+static inline void set_upload_byte_rate(void) {
+    // Sustained rate of the USB link, from the last upload long enough to measure it. Streams are sent at their
+    // capture rate and are not measured
+    if (counters_.upload_time >= UPLOAD_RATE_MIN_TIME)
+        upload_byte_rate_ = (uint)((uint64_t)counters_.upload_bytes * 1000000 / counters_.upload_time);
+}
+
+static inline uint get_bytes_per_sample(void) {
+    uint bytes = 0;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_1) == 0) bytes++;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_2) == 0) bytes++;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_3) == 0) bytes++;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_4) == 0) bytes++;
+    return bytes ? bytes : 1;
+}
+
+static inline uint get_channel_mask(void) {
+    return get_channelgroup_mask() & channel_mask_ & ((1u << CHANNEL_COUNT) - 1);
+}
+
+static inline uint get_channelgroup_mask(void) {
+    uint channel_mask = 0;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_1) == 0) channel_mask = 0xff;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_2) == 0) channel_mask |= 0xff << 8;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_3) == 0) channel_mask |= 0xff << 16;
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_4) == 0) channel_mask |= 0xffu << 24;
+    return channel_mask;
 }
 
 static inline void send_sample(uint sample) {
-    if ((flags_ & FLAG_DISABLE_CHANGROUP_1) == 0) putchar(sample);
-    if ((flags_ & FLAG_DISABLE_CHANGROUP_2) == 0) putchar(sample >> 8);
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_1) == 0) send_byte(sample);
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_2) == 0) send_byte(sample >> 8);
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_3) == 0) send_byte(sample >> 16);
+    if ((flags_ & FLAG_DISABLE_CHANGROUP_4) == 0) send_byte(sample >> 24);
 }
 
 static inline void send_sample_rle(uint sample, uint count) {
-    if ((flags_ & FLAG_DISABLE_CHANGROUP_1) || (flags_ & FLAG_DISABLE_CHANGROUP_2)) {
-        uint8_t value = (1 << 7) | (count - 1);
-        putchar(value);
-        send_sample(sample);
-        debug("\nSample: 0x%02X Count: %u", sample, count);
-    } else {
-        uint16_t value = (1 << 15) | (count - 1);
-        putchar(value);
-        putchar(value >> 8);
-        send_sample(sample);
-        debug("\nSample: 0x%04X Count: %u", sample, count);
+    // Count first, with the size of a sample and the most significant bit set
+    uint bytes = get_bytes_per_sample();
+    uint32_t value = (1u << (8 * bytes - 1)) | (count - 1);
+    for (uint i = 0; i < bytes; i++) send_byte(value >> (8 * i));
+    send_sample(sample);
+    debug_verbose("\nSample: 0x%04X Count: %u", sample, count);
+}
+
+static inline void send_byte(uint8_t value) {
+    send_buffer_[send_buffer_count_++] = value;
+    if (send_buffer_count_ == SEND_BUFFER_SIZE) send_flush();
+}
+
+static inline void send_flush(void) {
+    // Hand the whole block to the CDC driver. This bypasses per character stdio calls and CR/LF translation
+    if (send_buffer_count_) {
+        if (is_upload_queued_) {
+            upload_push();
+        } else {
+            stdio_usb.out_chars((const char *)send_buffer_, send_buffer_count_);
+            send_bytes_ += send_buffer_count_;
+        }
+        send_buffer_count_ = 0;
     }
 }
 
+static inline void upload_push(void) {
+    // Core1. Publish the current block and wait for a free block to encode the next samples
+    upload_queue_[upload_head_ & (UPLOAD_QUEUE_SIZE - 1)].count = send_buffer_count_;
+    __dmb();
+    upload_head_++;
+    while (upload_head_ - upload_tail_ == UPLOAD_QUEUE_SIZE && !upload_is_aborted_) tight_loop_contents();
+    send_buffer_ = upload_queue_[upload_head_ & (UPLOAD_QUEUE_SIZE - 1)].data;
+}
+
+static void command_receive(void *param) {
+    /*
+     * Stdio receive callback. Read the received bytes into the command ring and follow the command boundaries to flag
+     * a reset. If the ring is full, the bytes are left in the stdio buffer until sump_read() frees space
+     */
+
+    (void)param;
+    while (command_head_ - command_tail_ < COMMAND_RING_SIZE) {
+        int c = getchar_timeout_us(0);
+        if (c == PICO_ERROR_TIMEOUT) return;
+        command_ring_[command_head_ & (COMMAND_RING_SIZE - 1)] = c;
+        command_head_++;
+        if (receive_value_count_) {
+            receive_value_count_--;
+        } else if (get_command_size(c) > 1) {
+            receive_value_count_ = get_command_size(c) - 1;
+        } else if (c == 0x00) {
+            is_reset_received_ = true;
+        }
+    }
+    is_receive_stalled_ = true;
+}
+
+static inline int command_get(void) {
+    // First byte of the next whole command, or -1. Long commands wait for their value, up to the command timeout
+    uint available = command_head_ - command_tail_;
+    if (!available) return -1;
+    uint8_t c = command_ring_[command_tail_ & (COMMAND_RING_SIZE - 1)];
+    uint size = get_command_size(c);
+    if (available < size) {
+        if (!command_time_) command_time_ = time_us_64();
+        if (time_us_64() - command_time_ < COMMAND_TIMEOUT_US) return -1;
+        uint32_t status = save_and_disable_interrupts();
+        command_tail_ = command_head_;
+        receive_value_count_ = 0;
+        restore_interrupts(status);
+        command_time_ = 0;
+        debug("\nCommand timeout: 0x%X (%u of %u bytes)", c, available, size);
+        return -1;
+    }
+    command_time_ = 0;
+    command_get_byte();
+    if (c == 0x00) is_reset_received_ = false;
+    return c;
+}
+
+static inline uint get_command_size(uint8_t command) {
+    if (command_table_[command].size) return command_table_[command].size;
+    return command & 0x80 ? COMMAND_LONG_SIZE : 1;
+}
+
+static inline uint8_t command_get_byte(void) {
+    uint8_t value = command_ring_[command_tail_ & (COMMAND_RING_SIZE - 1)];
+    command_tail_++;
+    if (is_receive_stalled_) {
+        // Read the bytes left in the stdio buffer
+        is_receive_stalled_ = false;
+        uint32_t status = save_and_disable_interrupts();
+        command_receive(NULL);
+        restore_interrupts(status);
+    }
+    return value;
+}
+
 static inline uint32_t get_uint32(void) {
-    uint32_t value = getchar_timeout_us(1000);
-    value |= getchar_timeout_us(1000) << 8;
-    value |= getchar_timeout_us(1000) << 16;
-    value |= getchar_timeout_us(1000) << 24;
+    // The whole command is in the ring (see command_get())
+    uint32_t value = command_get_byte();
+    value |= command_get_byte() << 8;
+    value |= command_get_byte() << 16;
+    value |= (uint32_t)command_get_byte() << 24;
     return value;
 }
 
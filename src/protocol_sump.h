@@ -27,9 +27,13 @@ extern "C" {
 
 extern capture_config_t capture_config_;
 extern config_t config_;
+extern counters_t counters_;
 
+void sump_init(void);
+bool sump_is_reset_received(void);
 uint sump_read(void);
 void sump_send_samples(void);
+void sump_send_stream(void);
 void sump_reset(void);
 
 #ifdef __cplusplus